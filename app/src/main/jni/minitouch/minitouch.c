@@ -1,77 +1,142 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sched_setaffinity 和 CPU_SET，bionic 上总是可用
+#endif
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <signal.h>
+#include <stdint.h>
 #include <libevdev.h>
+#include <libevdev-uinput.h>
 #include <sys/types.h>
 #include <asm/types.h>
 #include <linux/netlink.h>
 
 #define MAX_SUPPORTED_CONTACTS 10
+#define MAX_FRAME_EVENTS 256 // 一帧内缓存的最大事件数，写满后会提前刷出
 #define VERSION 1
 #define DEFAULT_SOCKET_NAME "minitouch"
-#define EVENT_NUM 12
-
+#define DEFAULT_CACHE_FILE "/data/local/tmp/minitouch.cache" // 上次选中的触控设备
+#define MAX_CLIENTS 8 // 同时连接的 socket 客户端上限
+#define MAX_SERVE_EVENTS (MAX_CLIENTS * 2 + 5) // 客户端及其共享内存队列、两个监听 socket、两个定时器和指令队列
+#define MAX_SOURCE_DEVICES 16 // 同时独占的键盘等输入源设备上限
+#define MAX_REGISTERED_DEVICES 64 // 设备表最多记录的输入设备节点数
+#define MAX_TOUCH_DEVICES 4 // -A 同时打开的触控设备上限
+#define SOURCE_EVENT_BATCH 64 // 每次从输入源设备批量取出的事件数
+#define COMMAND_QUEUE_SIZE 1024 // 输入线程发往注入线程的指令队列长度，必须是 2 的幂
+#define TAP_DURATION_US 50000 // 映射为 tap 的按键默认按住的时间
+#define KEYMAP_PRESSURE 50 // 按键映射出的触控点的压力
+#define MOUSE_IDLE_US 100000 // 鼠标停止移动多久后抬起拖动的触控点
+#define WHEEL_IDLE_US 150000 // 滚轮停止多久后抬起缩放的两个触控点
+#define WHEEL_START_STEPS 4 // 缩放开始时的两指间距（以滚轮一格为单位）
+#define WHEEL_STEP_FRAMES 4 // 滚轮每一格分几帧完成
+#define INPUT_OWNER_MOUSE KEY_CNT // 被鼠标拖动占用的逻辑触控点
+#define INPUT_OWNER_WHEEL (KEY_CNT + 1) // 被滚轮缩放占用的逻辑触控点
+#define INPUT_OWNER_STICK (KEY_CNT + 2) // 被虚拟摇杆占用的逻辑触控点
+#define DEFAULT_STICK_DEADZONE 10 // 摇杆的默认死区（百分比）
+#define READ_BUFFER_SIZE 65536 // 每个客户端的输入缓冲，等待期间会继续预读到这里
+#define OUTPUT_BUFFER_SIZE 65536 // 每个客户端尚未写出的回复，超过一半时暂停读取，写满时断开连接
+#define RING_MAGIC 0x4752544d // 共享内存环形队列的头部标识，小端序的 "MTRG"
+#define SPIN_WAIT_US 250 // 定时等待最后阶段忙等的微秒数
+#define SCRIPT_WINDOW_EVENTS 65536 // -f 脚本最多预先编译、尚未写出的事件数
+#define MAX_SCHEDULE_LAG_US 20000 // 落后上一次等待的结束时间超过这个值时，下一次等待从当前时间重新计算
+#define DEFAULT_FRAME_RATE 120 // 手势等由 minitouch 自行生成的事件的默认帧率
+#define DEFAULT_REALTIME_PRIORITY 10 // --realtime 的默认 SCHED_FIFO 优先级
+#define PREFAULT_STACK_SIZE (256 * 1024) // --realtime 预先访问并锁定的栈大小
+#define JITTER_PERIOD_US 1000 // --jitter-test 每次定时唤醒的间隔
+#define DEFAULT_JITTER_SECONDS 10 // --jitter-test 的默认时长
+
+#ifndef F_GET_SEALS // 旧的 libc 头文件中没有，值来自 linux/fcntl.h
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SHRINK 0x0002
+#endif
 
 static int g_verbose = 0;
-
-
-static
-char *event_str[EVENT_NUM] =
-        {
-                "IN_ACCESS",
-                "IN_MODIFY",
-                "IN_ATTRIB",
-                "IN_CLOSE_WRITE",
-                "IN_CLOSE_NOWRITE",
-                "IN_OPEN",
-                "IN_MOVED_FROM",
-                "IN_MOVED_TO",
-                "IN_CREATE",
-                "IN_DELETE",
-                "IN_DELETE_SELF",
-                "IN_MOVE_SELF"
-        };
-
-
+static int g_frame_rate = DEFAULT_FRAME_RATE;
 
 static void usage(const char *pname) {
     fprintf(stderr,
-            "Usage: %s [-h] [-d <device>] [-n <name>] [-v] [-i] [-f <file>]\n"
+            "Usage: %s [-h] [-d <device>] [-n <name>] [-v] [-i] [-f <file>] [-r <hz>]\n"
+            "          [-u] [-F <a|b>] [-S <sink>] [-b <corpus>] [-C <file>]\n"
+            "          [-k <file>] [-o <file>] [-t <file>] [-x <factor>]\n"
+            "          [-p [<address>:]<port>] [-P <hz>] [-A] [--realtime[=<priority>]]\n"
+            "          [--cpu <n>] [--jitter-test[=<seconds>]]\n"
             "  -d <device>: Use the given touch device. Otherwise autodetect.\n"
             "  -n <name>:   Change the name of of the abtract unix domain socket. (%s)\n"
             "  -v:          Verbose output.\n"
             "  -i:          Uses STDIN and doesn't start socket.\n"
             "  -f <file>:   Runs a file with a list of commands, doesn't start socket.\n"
+            "  -r <hz>:     Frame rate of generated gestures. (%d)\n"
+            "  -u:          Inject into a virtual copy of the touch device via uinput.\n"
+            "  -F <a|b>:    Use a fake type A or B touch device instead of a real one.\n"
+            "  -S <sink>:   Where the fake device writes to: null, memfd or capture. (null)\n"
+            "  -b <corpus>: Benchmark with taps, chaos, swipes or all, then exit.\n"
+            "  -C <file>:   Remember the detected touch device here, empty disables. (%s)\n"
+            "  -k <file>:   Map keyboard keys to taps, holds and swipes as listed in the file.\n"
+            "  -o <file>:   Record the touch device to a trace file until interrupted.\n"
+            "  -t <file>:   Replay a trace file recorded with -o, doesn't start socket.\n"
+            "  -x <factor>: Replay speed, 2 replays twice as fast. (1)\n"
+            "  -p <port>:   Also listen on this TCP port, on 127.0.0.1 unless an address is given.\n"
+            "  -P <hz>:     Write at most one frame per refresh at this rate, merging the rest.\n"
+            "  -A:          Also open every other touch device, clients pick one with D.\n"
+            "  --realtime[=<priority>]:\n"
+            "               Inject with SCHED_FIFO at this priority and locked memory. (%d)\n"
+            "  --cpu <n>:   Pin the injecting thread to this CPU.\n"
+            "  --jitter-test[=<seconds>]:\n"
+            "               Measure timer wake-up latency for this long, then exit. (%d)\n"
             "  -h:          Show help.\n",
-            pname, DEFAULT_SOCKET_NAME
+            pname, DEFAULT_SOCKET_NAME, DEFAULT_FRAME_RATE, DEFAULT_CACHE_FILE,
+            DEFAULT_REALTIME_PRIORITY, DEFAULT_JITTER_SECONDS
     );
 }
 
 typedef struct {
-    int enabled;
+    int enabled; // 0 未按下，1 本帧按下，2 已按下，3 本帧抬起
+    int changed; // enabled 为 2 时，本帧是否移动过
     int tracking_id;
     int x;
     int y;
     int pressure;
+    int sent_x; // type B 已写入设备的值，未变化的值不再重复写入
+    int sent_y;
+    int sent_pressure;
+    const void *owner; // 改动了这个触控点、还没有 'c' 的客户端，NULL 表示改动已提交，下一帧写出
 } contact_t; //用来表示触控点的结构体
 
 typedef struct {
-    int fd; //文件描述符
+    int fd; //文件描述符，事件写入这里（使用虚拟设备时为 uinput 的 fd）
     int score; //触摸设备的匹配分值
     char path[100]; //设备的event路径 dev/input/device4
+    char name[256]; //设备名称
+    struct input_id id; //设备的 bustype、vendor、product、version
     struct libevdev *evdev;
+    struct libevdev_uinput *uinput; //镜像触控设备的虚拟设备，NULL 表示直接写入触控设备
     int has_mtslot; //type B
     int has_tracking_id; // type B
     int has_key_btn_touch;
@@ -85,28 +150,128 @@ typedef struct {
     int max_contacts;  //最大的触控点数 多点触控  软件（多点触控具体实现）  屏幕硬件支持（10  小米8（8））
     int max_tracking_id;
     int tracking_id; //type b协议中使用的用来区分触控点的 tracking_id  type B 有状态的多点触控协议
+    unsigned int serial; //设备表中该设备的序号，0 表示不在设备表中
+    int index; //'D' 指令选择设备时使用的编号，主触控设备为 0
     contact_t contacts[MAX_SUPPORTED_CONTACTS]; // 多点触控点数的数组，最多支持10个触控点
     int active_contacts; //可用的触控点击
+    struct input_event frame[MAX_FRAME_EVENTS]; // 当前帧尚未写入设备的事件，commit 时一次性写出
+    int frame_len; // frame 中已缓存的事件数
+    int frame_events; // 当前帧的事件数（包括提前刷出的），用于统计
+    int frame_commands; // 当前帧的指令数，用于统计
+    uint64_t frame_received; // 当前帧中最早一条指令的读取时间（微秒），0 表示未知
+    uint64_t frame_started; // 当前帧第一条指令执行的时间（纳秒），0 表示帧为空
+    int capturing; // 为 1 时事件写入 capture 而不是 fd（基准测试、离线编译用）
+    struct input_event *capture;
+    size_t capture_len;
+    size_t capture_size;
+    uint64_t pace_period; // -P 的帧间隔（纳秒），0 表示提交后立即写出
+    uint64_t pace_next; // 下一帧最早可以写出的时间（纳秒）
+    int frame_held; // 已提交、要等到 pace_next 才写出的帧，之后的提交合并进来
 } internal_state_touchpad_t; // 记录触控设备的结构体
 
 
 typedef struct {
     int fd;
+    int type; // DEVICE_*
     char path[100]; // dev/input/event10 键盘设备
-    struct libevdev *evdev;
-} internal_state_keyboard_t; //表示键盘设备的结构体
+    struct libevdev *evdev; // NULL 表示空闲
+} internal_state_keyboard_t; //表示键盘等输入源设备的结构体
+
+// 所有被独占的输入源设备，由输入线程统一读取
+static internal_state_keyboard_t g_sources[MAX_SOURCE_DEVICES];
+
+enum {
+    KEY_ACTION_NONE,
+    KEY_ACTION_TAP, // 按下后点击一次
+    KEY_ACTION_HOLD, // 按键按住期间一直按住
+    KEY_ACTION_SWIPE, // 按下后从起点滑到终点
+};
+
+typedef struct {
+    int type; // KEY_ACTION_*
+    int x0, y0; // 按下的位置
+    int x1, y1; // KEY_ACTION_SWIPE 的终点
+    uint64_t duration; // KEY_ACTION_TAP、KEY_ACTION_SWIPE 的持续时间（微秒）
+} key_action_t;
+
+typedef struct {
+    int enabled;
+    int x, y; // 拖动的起点，一般是视角区域的中心
+    int radius; // 离起点超过这个距离后抬起，再从起点重新开始拖动
+} mouse_action_t; // 鼠标移动映射为拖动
+
+typedef struct {
+    int enabled;
+    int x, y; // 双指缩放的中心
+    int step; // 滚轮每一格两指间距的变化
+} wheel_action_t; // 鼠标滚轮映射为双指缩放
+
+typedef struct {
+    int enabled;
+    int x, y; // 虚拟摇杆的中心
+    int radius; // 摇杆推到底时离中心的距离
+    int deadzone; // 死区，摇杆偏移小于这个百分比时视为松开
+} stick_action_t; // 手柄摇杆映射为虚拟摇杆
+
+typedef struct {
+    key_action_t actions[KEY_CNT]; // 以键码为下标
+    mouse_action_t mouse;
+    wheel_action_t wheel;
+    stick_action_t sticks[2]; // 左摇杆（ABS_X、ABS_Y）和右摇杆（ABS_RX、ABS_RY）
+} keymap_t; // 由映射文件编译成的按键映射表
+
+typedef struct {
+    int key; // 占用该触控点的键码，0 表示空闲
+    key_action_t action; // 按下时的映射，重新加载映射文件不影响进行中的动作
+    uint64_t start; // 按下的时间（微秒）
+} input_contact_t; // 输入线程的一个逻辑触控点
 
+typedef struct {
+    int contact; // 拖动使用的逻辑触控点，-1 表示未按下
+    int lift; // 已超出半径，下一帧抬起
+    long x, y; // 当前位置
+    long dx, dy; // 自上一帧以来累计的移动
+    uint64_t last_motion; // 最近一次移动的时间（微秒）
+} mouse_state_t;
+
+typedef struct {
+    int contacts[2]; // 缩放使用的两个逻辑触控点，-1 表示未按下
+    int spread; // 当前两指间距
+    int target; // 滚轮累计出的目标间距
+    uint64_t last; // 最近一次滚动或移动的时间（微秒）
+} wheel_state_t;
 
 typedef struct {
-    internal_state_touchpad_t touchpad;
-    internal_state_keyboard_t keyboard;
-} internal_state_warper;
+    int contact; // 虚拟摇杆使用的逻辑触控点，-1 表示未按下
+    double dx, dy; // 摇杆当前的偏移，-1 ~ 1
+    long x, y; // 最近一次发出的位置
+    int dirty; // 自上一帧以来摇杆有变化
+} stick_state_t;
+
+// 以下只在输入线程中访问
+static keymap_t *g_keymap;
+static const char *g_keymap_file; // 映射文件，NULL 表示使用默认映射
+static const char *g_keymap_name; // 映射文件的文件名部分，用于匹配 inotify 事件
+static int g_keymap_wd = -1; // 映射文件所在目录的 inotify watch
+static input_contact_t g_input_contacts[MAX_SUPPORTED_CONTACTS];
+static int g_input_pending; // 自上次提交后是否放入过指令
+static int g_input_timer_fd = -1; // 输入线程的帧定时器
+static int g_input_timer_armed;
+static mouse_state_t g_mouse = {-1};
+static wheel_state_t g_wheel = {{-1, -1}};
+static stick_state_t g_sticks[2] = {{-1}, {-1}};
 
-static void mappingKeyboardEvent(struct input_event *pEvent, internal_state_touchpad_t *ptr);
+static void mappingKeyboardEvent(struct input_event *pEvent);
 
-static void dealWithActionUp(struct input_event *pEvent, internal_state_touchpad_t *touchpad);
+static void mappingMouseEvent(struct input_event *pEvent);
 
-static void dealWithActionDown(struct input_event *pEvent, internal_state_touchpad_t *touchpad);
+static void mappingGamepadEvent(struct input_event *pEvent, const struct libevdev *evdev);
+
+static void dealWithActionUp(struct input_event *pEvent);
+
+static void dealWithActionDown(struct input_event *pEvent);
+
+static void setup_touch_device(internal_state_touchpad_t *state);
 
 
 
@@ -141,143 +306,306 @@ static int is_character_device(const char *devpath) { //https://cnbin.github.io/
     return 1;
 }
 
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define NBITS(x) ((((x) - 1) / BITS_PER_LONG) + 1)
+
+enum {
+    DEVICE_TOUCH = 1,
+    DEVICE_KEYBOARD = 2,
+    DEVICE_MOUSE = 4,
+    DEVICE_GAMEPAD = 8,
+};
+
+/**
+ * 只通过 ioctl 读取设备分类和触控设备打分所需的能力位，
+ * 比 libevdev_new_from_fd 读取全部状态要快得多
+ */
+typedef struct {
+    char name[256];
+    struct input_id id;
+    unsigned long ev_bits[NBITS(EV_CNT)];
+    unsigned long key_bits[NBITS(KEY_CNT)];
+    unsigned long abs_bits[NBITS(ABS_CNT)];
+    unsigned long rel_bits[NBITS(REL_CNT)];
+    unsigned long prop_bits[NBITS(INPUT_PROP_CNT)];
+    struct input_absinfo tool_type; // ABS_MT_TOOL_TYPE
+    struct input_absinfo slot; // ABS_MT_SLOT
+    struct input_absinfo x; // ABS_MT_POSITION_X
+    struct input_absinfo y; // ABS_MT_POSITION_Y
+} device_probe_t;
+
+static int test_bit(const unsigned long *bits, int bit) {
+    return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
 /**
  * 判断是否是触控设备
- * @param evdev
+ * @param probe
  * @return
  */
-static int is_multitouch_device(struct libevdev *evdev) {
-    return libevdev_has_event_code(evdev, EV_ABS, ABS_MT_POSITION_X);
+static int is_multitouch_device(const device_probe_t *probe) {
+    return test_bit(probe->abs_bits, ABS_MT_POSITION_X);
 }
 
 /**
  * 判断是否是键盘设备
- * @param evdev
+ * @param probe
  * @return
  */
-static int is_keyboard_device(struct libevdev *evdev) { // 键盘 A S D F  https://zhidao.baidu.com/question/715096289382651925.html
-    int hasA = libevdev_has_event_code(evdev, EV_KEY, KEY_A);
-    int hasS = libevdev_has_event_code(evdev, EV_KEY, KEY_S);
-    int hasD = libevdev_has_event_code(evdev, EV_KEY, KEY_D);
-    int hasF = libevdev_has_event_code(evdev, EV_KEY, KEY_F);
+static int is_keyboard_device(const device_probe_t *probe) { // 键盘 A S D F  https://zhidao.baidu.com/question/715096289382651925.html
+    int hasA = test_bit(probe->key_bits, KEY_A);
+    int hasS = test_bit(probe->key_bits, KEY_S);
+    int hasD = test_bit(probe->key_bits, KEY_D);
+    int hasF = test_bit(probe->key_bits, KEY_F);
     return hasA && hasS && hasD && hasF;
 }
 
 /**
  * 判断是否是鼠标设备
- * @param evdev
+ * @param probe
  * @return
  */
-static int is_mouse_device(struct libevdev *evdev) {
-    return libevdev_has_event_code(evdev, EV_KEY, BTN_LEFT) &&
-           libevdev_has_event_code(evdev, EV_KEY, BTN_RIGHT);
+static int is_mouse_device(const device_probe_t *probe) {
+    return test_bit(probe->key_bits, BTN_LEFT) &&
+           test_bit(probe->key_bits, BTN_RIGHT) &&
+           test_bit(probe->rel_bits, REL_X) &&
+           test_bit(probe->rel_bits, REL_Y);
 }
 
 /**
- * 检测当前设备是否是键盘设备
- * @param devpath
- * @param state
+ * 判断是否是手柄设备：有左摇杆和 A（BTN_SOUTH）键
+ * @param probe
  * @return
  */
-static int consider_keyboard_device(const char *devpath, internal_state_keyboard_t *state) {
-    int fd = -1;
-    struct libevdev *evdev = NULL;
+static int is_gamepad_device(const device_probe_t *probe) {
+    return test_bit(probe->abs_bits, ABS_X) &&
+           test_bit(probe->abs_bits, ABS_Y) &&
+           test_bit(probe->key_bits, BTN_SOUTH);
+}
+
+/**
+ * 读取设备的名称、ID 和能力位，并对设备进行分类
+ * @param fd
+ * @param probe
+ * @return DEVICE_* 的组合，读取失败时返回 -1
+ */
+static int probe_device(int fd, device_probe_t *probe) {
+    int type = 0;
+
+    memset(probe, 0, sizeof(*probe));
+
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(probe->ev_bits)), probe->ev_bits) < 0) {
+        return -1;
+    }
+
+    ioctl(fd, EVIOCGNAME(sizeof(probe->name) - 1), probe->name);
+    ioctl(fd, EVIOCGID, &probe->id);
+    // Not supported before Linux 2.6.38, in which case there are no properties.
+    ioctl(fd, EVIOCGPROP(sizeof(probe->prop_bits)), probe->prop_bits);
+
+    if (test_bit(probe->ev_bits, EV_KEY)) {
+        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(probe->key_bits)), probe->key_bits);
+    }
+
+    if (test_bit(probe->ev_bits, EV_ABS)) {
+        ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(probe->abs_bits)), probe->abs_bits);
+    }
+
+    if (test_bit(probe->ev_bits, EV_REL)) {
+        ioctl(fd, EVIOCGBIT(EV_REL, sizeof(probe->rel_bits)), probe->rel_bits);
+    }
+
+    if (is_multitouch_device(probe)) {
+        type |= DEVICE_TOUCH;
+
+        if (test_bit(probe->abs_bits, ABS_MT_TOOL_TYPE)) {
+            ioctl(fd, EVIOCGABS(ABS_MT_TOOL_TYPE), &probe->tool_type);
+        }
+
+        if (test_bit(probe->abs_bits, ABS_MT_SLOT)) {
+            ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &probe->slot);
+        }
+
+        ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X), &probe->x);
+        ioctl(fd, EVIOCGABS(ABS_MT_POSITION_Y), &probe->y);
+    }
+
+    if (is_keyboard_device(probe)) {
+        type |= DEVICE_KEYBOARD;
+    }
+
+    if (is_mouse_device(probe)) {
+        type |= DEVICE_MOUSE;
+    }
+
+    if (is_gamepad_device(probe)) {
+        type |= DEVICE_GAMEPAD;
+    }
+
+    return type;
+}
+
+/**
+ * 打开设备并读取能力位
+ * @param devpath
+ * @param probe
+ * @param type 输出 DEVICE_* 的组合
+ * @return 设备的 fd，失败时返回 -1
+ */
+static int open_and_probe_device(const char *devpath, device_probe_t *probe, int *type) {
+    int fd;
+
     if (!is_character_device(devpath)) {
-        goto mismatch;
+        return -1;
     }
 
     if ((fd = open(devpath, O_RDWR)) < 0) { //O_RDWR，以可读可写的方式打开
         perror("open");
         fprintf(stderr, "Unable to open device %s for inspection", devpath);
-        goto mismatch;
+        return -1;
     }
 
-    if (libevdev_new_from_fd(fd, &evdev) < 0) {
-        fprintf(stderr, "Note: device %s is not supported by libevdev\n", devpath);
-        goto mismatch;
+    if ((*type = probe_device(fd, probe)) < 0) {
+        fprintf(stderr, "Note: device %s is not an input device\n", devpath);
+        close(fd);
+        return -1;
     }
 
+    return fd;
+}
 
-    libevdev_grab(evdev, LIBEVDEV_UNGRAB);
-
-    if (libevdev_grab(evdev, LIBEVDEV_GRAB) < 0)
-        libevdev_free(evdev);
+/**
+ * 判断设备是否是需要独占的输入源设备。鼠标和手柄只在指定了映射文件时才独占，
+ * 否则它们的输入没有任何映射，独占只会让系统失去这些设备
+ * @param probe
+ * @return DEVICE_KEYBOARD、DEVICE_MOUSE、DEVICE_GAMEPAD，不需要时返回 0
+ */
+static int source_device_type(const device_probe_t *probe) {
+    if (is_keyboard_device(probe)) {
+        return DEVICE_KEYBOARD;
+    }
 
-    if (is_keyboard_device(evdev)) {
-        state->evdev = evdev;
-        state->fd = fd;
-        strncpy(state->path, devpath, sizeof(state->path)); //将devpath拷贝到字符数组 state->path 中
-        fprintf(stderr, "Find keyboard device:%s,and the path is %s\n", libevdev_get_name(evdev),
-                devpath);
-        return fd;
+    if (is_mouse_device(probe) && g_keymap_file != NULL) {
+        return DEVICE_MOUSE;
     }
 
-    mismatch: //不是需要的设备
-    libevdev_grab(evdev, LIBEVDEV_UNGRAB);
-    libevdev_free(evdev);
-    if (fd >= 0) {
-        close(fd); //关闭文件流
+    if (is_gamepad_device(probe) && g_keymap_file != NULL) {
+        return DEVICE_GAMEPAD;
     }
 
-    return 0; //返回 0
+    return 0;
 }
 
 /**
- * 检测当前设备是否是鼠标设备
- * @return
+ * 独占输入源设备
+ * @param devpath
+ * @param fd 已经打开的设备，成功时由 state 接管
+ * @param probe
+ * @param type DEVICE_*
+ * @param state
+ * @return 成功时返回 1
  */
-//static int consider_mouse_device(){
-//    //todo
-//
-//}
+static int consider_source_probe(const char *devpath, int fd, const device_probe_t *probe,
+                                 int type, internal_state_keyboard_t *state) {
+    struct libevdev *evdev = NULL;
+
+    if (libevdev_new_from_fd(fd, &evdev) < 0) {
+        fprintf(stderr, "Note: device %s is not supported by libevdev\n", devpath);
+        return 0;
+    }
+
+    libevdev_grab(evdev, LIBEVDEV_UNGRAB);
+
+    if (libevdev_grab(evdev, LIBEVDEV_GRAB) < 0) {
+        fprintf(stderr, "Note: unable to grab input device %s\n", devpath);
+    }
+
+    state->evdev = evdev;
+    state->fd = fd;
+    state->type = type;
+    strncpy(state->path, devpath, sizeof(state->path) - 1); //将devpath拷贝到字符数组 state->path 中
+    fprintf(stderr, "Find %s device:%s,and the path is %s\n",
+            type == DEVICE_MOUSE ? "mouse" : type == DEVICE_GAMEPAD ? "gamepad" : "keyboard",
+            probe->name, devpath);
+    return 1;
+}
 
 /**
- * 检测当前设备是否是触控设备
+ * 把设备加入输入源列表
  * @param devpath
- * @param state
- * @return
+ * @param fd 已经打开的设备，加入时由 g_sources 接管
+ * @param probe
+ * @return 加入的设备，不是需要的设备或列表已满时返回 NULL
  */
-static int
-consider_touch_device(const char *devpath, internal_state_touchpad_t *state) { //state其实是evdev的包装类
-    int fd = -1;
-    struct libevdev *evdev = NULL; //对libevdev初始化为NULL
+static internal_state_keyboard_t *
+add_source_probe(const char *devpath, int fd, const device_probe_t *probe) {
+    int type = source_device_type(probe);
+    int i;
 
-    if (!is_character_device(devpath)) { //判断是否是字节设备
-        goto mismatch; //无条件转移语句
+    if (type == 0) {
+        return NULL;
     }
 
-    if ((fd = open(devpath, O_RDWR)) < 0) {   //监听触控输入设备
-        perror("open");
-        fprintf(stderr, "Unable to open device %s for inspection", devpath);
-        goto mismatch;
+    for (i = 0; i < MAX_SOURCE_DEVICES; ++i) {
+        if (g_sources[i].evdev == NULL) {
+            break;
+        }
     }
 
-    if (libevdev_new_from_fd(fd, &evdev) < 0) { //对 * evdev 指针进行初始化
-        fprintf(stderr, "Note: device %s is not supported by libevdev\n", devpath);
-        goto mismatch;
+    if (i == MAX_SOURCE_DEVICES) {
+        fprintf(stderr, "Note: too many input devices, ignoring %s\n", devpath);
+        return NULL;
     }
 
-    if (!is_multitouch_device(evdev)) { //判断是否是多点触控设备
-        goto mismatch;
+    if (!consider_source_probe(devpath, fd, probe, type, &g_sources[i])) {
+        return NULL;
     }
 
+    // 输入线程用 epoll 等待，读取时不能阻塞
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return &g_sources[i];
+}
+
+/**
+ * 释放输入源设备，并将其从列表中移除
+ * @param source
+ */
+static void remove_source_device(internal_state_keyboard_t *source) {
+    fprintf(stderr, "Input device %s removed\n", source->path);
+    libevdev_grab(source->evdev, LIBEVDEV_UNGRAB);
+    libevdev_free(source->evdev);
+    close(source->fd);
+    memset(source, 0, sizeof(*source));
+}
+
+/**
+ * 计算触控设备的匹配分值，分值越高越可能是主屏幕
+ * @param devpath
+ * @param probe
+ * @return 分值，不是可用的触控设备时返回 -1
+ */
+static int score_touch_device(const char *devpath, const device_probe_t *probe) {
+    if (!is_multitouch_device(probe)) { //判断是否是多点触控设备
+        return -1;
+    }
 
     int score = 10000; //这个score是做什么用的？？？ 适配工作
 
-    if (libevdev_has_event_code(evdev, EV_ABS, ABS_MT_TOOL_TYPE)) { // evdev 是输入设备的结构体指针
-        int tool_min = libevdev_get_abs_minimum(evdev, ABS_MT_TOOL_TYPE);
-        int tool_max = libevdev_get_abs_maximum(evdev, ABS_MT_TOOL_TYPE);
+    if (test_bit(probe->abs_bits, ABS_MT_TOOL_TYPE)) {
+        int tool_min = probe->tool_type.minimum;
+        int tool_max = probe->tool_type.maximum;
 
         if (tool_min > MT_TOOL_FINGER || tool_max < MT_TOOL_FINGER) {  //判断支持的触控点数
             fprintf(stderr, "Note: device %s is a touch device, but doesn't"
                             " support fingers\n", devpath);
-            goto mismatch;
+            return -1;
         }
 
         score -= tool_max - MT_TOOL_FINGER;
     }
 
-    if (libevdev_has_event_code(evdev, EV_ABS, ABS_MT_SLOT)) {
+    if (test_bit(probe->abs_bits, ABS_MT_SLOT)) {
         score += 1000;
 
         // Some devices, e.g. Blackberry PRIV (STV100) have more than one surface
@@ -290,7 +618,7 @@ consider_touch_device(const char *devpath, internal_state_touchpad_t *state) { /
         // safe bet, though we may also want to decrease the score by, say, 1,
         // if the device name contains "key" just in case they decide to start
         // supporting more contacts on both touch surfaces in the future.
-        int num_slots = libevdev_get_abs_maximum(evdev, ABS_MT_SLOT);
+        int num_slots = probe->slot.maximum;
         score += num_slots;
     }
 
@@ -298,7 +626,7 @@ consider_touch_device(const char *devpath, internal_state_touchpad_t *state) { /
     // Also some device like SO-03L it has two touch devices, one is for touch
     // one is for side sense which name is 'sec_touchscreen_side'.
     // So add one more check for '_side'. check issue #45 for more info
-    const char *name = libevdev_get_name(evdev); //获取设备名称
+    const char *name = probe->name; //获取设备名称
     if (strstr(name, "key") != NULL ||
         strstr(name, "_side") != NULL) { //判断 name 中是否包含"key"，或者"_slide"
         score -= 1;
@@ -308,7 +636,7 @@ consider_touch_device(const char *devpath, internal_state_touchpad_t *state) { /
     // to direct input. It seems to be related to accessibility, as it shows
     // a touchpoint that you can move around, and then tap to activate whatever
     // is under the point. That wrapper device lacks the direct property.
-    if (libevdev_has_property(evdev, INPUT_PROP_DIRECT)) {  //判断是否包含 INPUT_PROP_DIRECT 属性
+    if (test_bit(probe->prop_bits, INPUT_PROP_DIRECT)) {  //判断是否包含 INPUT_PROP_DIRECT 属性
         score += 10000;
     }
 
@@ -318,68 +646,252 @@ consider_touch_device(const char *devpath, internal_state_touchpad_t *state) { /
     // the sub_touch device is much much lower. It seems like a safe bet
     // to always prefer the larger device, as long as the score adjustment is
     // likely to be lower than the adjustment we do for INPUT_PROP_DIRECT.
-    if (libevdev_has_event_code(evdev, EV_ABS, ABS_MT_POSITION_X)) {
-        int x = libevdev_get_abs_maximum(evdev, ABS_MT_POSITION_X);
-        int y = libevdev_get_abs_maximum(evdev, ABS_MT_POSITION_Y);
-        score += sqrt(x * y);
+    score += sqrt((double) probe->x.maximum * probe->y.maximum);
+
+    return score;
+}
+
+/**
+ * 检测当前设备是否是比 state 中已有的设备更合适的触控设备
+ * @param devpath
+ * @param fd 已经打开的设备，匹配时由 state 接管
+ * @param probe
+ * @param state
+ * @return 匹配时返回 1
+ */
+static int consider_touch_probe(const char *devpath, int fd, const device_probe_t *probe,
+                                internal_state_touchpad_t *state) {
+    int score = score_touch_device(devpath, probe);
+
+    if (score < 0) {
+        return 0;
     }
 
-    if (state->evdev != NULL) {
+    if (state->score > 0) {
         if (state->score >= score) {
             fprintf(stderr, "Note: device %s was outscored by %s (%d >= %d)\n",
                     devpath, state->path, state->score, score);
-            goto mismatch; //如果计算出值score小于state->score，则说明不匹配（其实是一些特殊设备的匹配问题）
+            return 0; //如果计算出值score小于state->score，则说明不匹配（其实是一些特殊设备的匹配问题）
         } else {
             fprintf(stderr, "Note: device %s was outscored by %s (%d >= %d)\n",
                     state->path, devpath, score, state->score);
         }
-    }
 
-    libevdev_free(state->evdev); //释放资源
+        close(state->fd);
+    }
 
     state->fd = fd;
     state->score = score;
-    strncpy(state->path, devpath, sizeof(state->path)); //将devpath拷贝到字符数组 state->path 中
-    state->evdev = evdev;
+    state->id = probe->id;
+    strncpy(state->path, devpath, sizeof(state->path) - 1); //将devpath拷贝到字符数组 state->path 中
+    strncpy(state->name, probe->name, sizeof(state->name) - 1);
 
     return 1;
+}
+
+/**
+ * 检测当前设备是否是触控设备
+ * @param devpath
+ * @param state
+ * @return
+ */
+static int
+consider_touch_device(const char *devpath, internal_state_touchpad_t *state) { //state其实是evdev的包装类
+    device_probe_t probe;
+    int type;
+    int fd = open_and_probe_device(devpath, &probe, &type);
 
-    mismatch: //不是需要的设备
-    libevdev_free(evdev);  //释放资源
+    if (fd < 0) {
+        return 0;
+    }
 
-    if (fd >= 0) {
-        close(fd); //关闭文件流
+    if (consider_touch_probe(devpath, fd, &probe, state)) {
+        return 1;
     }
 
+    close(fd); //关闭文件流
     return 0; //返回 0
 }
 
+/**
+ * 对选中的触控设备创建 libevdev，只对最终选中的设备做一次完整的初始化
+ * @param state
+ * @return 0 成功，-1 失败
+ */
+static int open_touch_device(internal_state_touchpad_t *state) {
+    if (libevdev_new_from_fd(state->fd, &state->evdev) < 0) { //对 * evdev 指针进行初始化
+        fprintf(stderr, "Note: device %s is not supported by libevdev\n", state->path);
+        state->evdev = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    char path[100]; // 空字符串表示空闲
+    int type; // DEVICE_* 的组合
+    int score; // 触控设备的匹配分值，不是可用的触控设备时为 -1
+    unsigned int serial; // 每次加入时递增，用来区分同一节点上先后出现的设备
+} device_entry_t;
+
+// /dev/input 下每个输入设备的探测结果。启动时遍历一次，之后只随热插拔逐个更新，
+// 触控设备消失或出现更合适的触控设备时直接从这里选出新的目标，不再重新遍历。
+// 输入线程更新，注入线程切换触控设备时读取，所以用锁保护
+static device_entry_t g_devices[MAX_REGISTERED_DEVICES];
+static unsigned int g_device_serial;
+static pthread_mutex_t g_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_touch_hotplug; // 自动检测的触控设备是否随热插拔切换
+
+/**
+ * 把设备加入设备表
+ * @param path
+ * @param type DEVICE_* 的组合
+ * @param score 触控设备的匹配分值，-1 表示不是可用的触控设备
+ * @return 加入时返回 1，已经在表中或表已满时返回 0
+ */
+static int register_device(const char *path, int type, int score) {
+    device_entry_t *free_entry = NULL;
+    int i;
+
+    pthread_mutex_lock(&g_devices_lock);
+
+    for (i = 0; i < MAX_REGISTERED_DEVICES; ++i) {
+        if (g_devices[i].path[0] == 0) {
+            free_entry = free_entry != NULL ? free_entry : &g_devices[i];
+        } else if (strcmp(g_devices[i].path, path) == 0) {
+            free_entry = NULL;
+            break;
+        }
+    }
+
+    if (free_entry != NULL) {
+        strncpy(free_entry->path, path, sizeof(free_entry->path) - 1);
+        free_entry->type = type;
+        free_entry->score = score;
+        free_entry->serial = ++g_device_serial;
+    }
+
+    pthread_mutex_unlock(&g_devices_lock);
+
+    return free_entry != NULL;
+}
+
+/**
+ * 把设备从设备表中移除
+ * @param path
+ * @return 移除的设备的 DEVICE_* 组合，不在表中时返回 -1
+ */
+static int unregister_device(const char *path) {
+    int type = -1;
+    int i;
+
+    pthread_mutex_lock(&g_devices_lock);
+
+    for (i = 0; i < MAX_REGISTERED_DEVICES; ++i) {
+        if (g_devices[i].path[0] != 0 && strcmp(g_devices[i].path, path) == 0) {
+            type = g_devices[i].type;
+            memset(&g_devices[i], 0, sizeof(g_devices[i]));
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_devices_lock);
+
+    return type;
+}
+
+/**
+ * 查找设备在设备表中的序号
+ * @param path
+ * @return 序号，不在表中时返回 0
+ */
+static unsigned int registered_serial(const char *path) {
+    unsigned int serial = 0;
+    int i;
+
+    pthread_mutex_lock(&g_devices_lock);
+
+    for (i = 0; i < MAX_REGISTERED_DEVICES; ++i) {
+        if (g_devices[i].path[0] != 0 && strcmp(g_devices[i].path, path) == 0) {
+            serial = g_devices[i].serial;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_devices_lock);
+
+    return serial;
+}
+
+/**
+ * 找出设备表中分值最高的触控设备
+ * @param entry 输出找到的设备
+ * @return 找到时返回 1
+ */
+static int best_touch_device(device_entry_t *entry) {
+    int found = 0;
+    int i;
+
+    pthread_mutex_lock(&g_devices_lock);
+
+    for (i = 0; i < MAX_REGISTERED_DEVICES; ++i) {
+        if (g_devices[i].path[0] != 0 && g_devices[i].score >= 0 &&
+            (!found || g_devices[i].score > entry->score)) {
+            *entry = g_devices[i];
+            found = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&g_devices_lock);
+
+    return found;
+}
+
 static int
 walk_devices(const char *path, internal_state_touchpad_t *state,
-             internal_state_keyboard_t *keyboard_state) { // 对 /dev/input 目录进行遍历，判断是否是可用设备
+             int with_sources) { // 对 /dev/input 目录进行遍历，判断是否是可用设备
     DIR *dir;
     struct dirent *ent; //目录
-    char touchpad_path[FILENAME_MAX]; //触控设备的设备节点
-    char keyboard_path[FILENAME_MAX];  //键盘设备的设备节点
+    char device_path[FILENAME_MAX]; //设备节点
+    device_probe_t probe;
+    int type;
+    int fd;
 
     if ((dir = opendir(path)) == NULL) {
         perror("opendir");
         return -1;
     }
 
+    // Every node is opened once and classified from its capability bits
+    // alone. state may be NULL if no touch device is needed.
     while ((ent = readdir(dir)) != NULL) {
         if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
             continue;
         }
 
-        snprintf(touchpad_path, FILENAME_MAX, "%s/%s", path, ent->d_name);
+        snprintf(device_path, FILENAME_MAX, "%s/%s", path, ent->d_name);
+
+        if ((fd = open_and_probe_device(device_path, &probe, &type)) < 0) {
+            continue;
+        }
 
-        snprintf(keyboard_path, FILENAME_MAX, "%s/%s", path, ent->d_name);
+        // Remembered even when a cached touch device is used, so that hotplug
+        // can pick the next best one without walking the directory again.
+        register_device(device_path, type,
+                        (type & DEVICE_TOUCH) ? score_touch_device(device_path, &probe) : -1);
 
-        consider_touch_device(touchpad_path, state);
+        if (state != NULL && (type & DEVICE_TOUCH) &&
+            consider_touch_probe(device_path, fd, &probe, state)) {
+            continue;
+        }
 
-        consider_keyboard_device(keyboard_path, keyboard_state);
+        if (with_sources && (type & (DEVICE_KEYBOARD | DEVICE_MOUSE | DEVICE_GAMEPAD)) &&
+            add_source_probe(device_path, fd, &probe) != NULL) {
+            continue;
+        }
 
+        close(fd);
     }
 
     closedir(dir);
@@ -387,31 +899,373 @@ walk_devices(const char *path, internal_state_touchpad_t *state,
     return 0;
 }
 
-#define WRITE_EVENT(state, type, code, value) _write_event(state, type, #type, code, #code, value)
+/**
+ * 从缓存文件中读取上次选中的触控设备，设备节点、input_id 和名称都一致时直接使用
+ * @param cache_file
+ * @param state
+ * @return 命中缓存时返回 1
+ */
+static int load_cached_touch_device(const char *cache_file, internal_state_touchpad_t *state) {
+    char path[100];
+    char name[256];
+    struct input_id id;
+    unsigned int bustype, vendor, product, version;
+    device_probe_t probe;
+    int type;
+    int fd;
+    FILE *file = fopen(cache_file, "r");
 
-static int _write_event(internal_state_touchpad_t *state,
-                        uint16_t type, const char *type_name,
-                        uint16_t code, const char *code_name,
-                        int32_t value) {
-    // It seems that most devices do not require the event timestamps at all.
-    // Left here for reference should such a situation arise.
-    //
-    //   timespec ts;
-    //   clock_gettime(CLOCK_MONOTONIC, &ts);
-    //   input_event event = {{ts.tv_sec, ts.tv_nsec / 1000}, type, code, value};
+    if (file == NULL) {
+        return 0;
+    }
 
-    struct input_event event = {{0, 0}, type, code, value}; //对 input_event 进行赋值
-    ssize_t result;
-    ssize_t length = (ssize_t) sizeof(event);
+    int matched = fscanf(file, "%99s %x %x %x %x %255[^\n]",
+                         path, &bustype, &vendor, &product, &version, name);
+    fclose(file);
 
-    if (g_verbose)
-        fprintf(stderr, "%-12s %-20s %08x\n", type_name, code_name, value); //输出日志
+    if (matched != 6) {
+        return 0;
+    }
 
-    result = write(state->fd, &event, length); //写入事件
-    return result - length;
-}
+    if ((fd = open_and_probe_device(path, &probe, &type)) < 0) {
+        return 0;
+    }
 
-static int next_tracking_id(internal_state_touchpad_t *state) {
+    id.bustype = bustype;
+    id.vendor = vendor;
+    id.product = product;
+    id.version = version;
+
+    // Event nodes are renumbered freely across boots and hotplugs, so only
+    // trust the cache if it's still the very same device.
+    if (memcmp(&id, &probe.id, sizeof(id)) != 0 || strcmp(name, probe.name) != 0 ||
+        !consider_touch_probe(path, fd, &probe, state)) {
+        fprintf(stderr, "Note: cached touch device %s is stale\n", path);
+        close(fd);
+        return 0;
+    }
+
+    fprintf(stderr, "Using cached touch device %s\n", path);
+
+    return 1;
+}
+
+/**
+ * 将选中的触控设备写入缓存文件，写入失败时忽略
+ * @param cache_file
+ * @param state
+ */
+static void save_cached_touch_device(const char *cache_file, const internal_state_touchpad_t *state) {
+    FILE *file = fopen(cache_file, "w");
+
+    if (file == NULL) {
+        return;
+    }
+
+    fprintf(file, "%s %04x %04x %04x %04x %s\n", state->path,
+            state->id.bustype, state->id.vendor, state->id.product, state->id.version,
+            state->name);
+    fclose(file);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 编译 -f 脚本时使用的虚拟时钟（微秒），等待只推进这个时钟，0 表示使用真实时间
+static uint64_t g_script_clock = 0;
+
+static uint64_t now_us(void) {
+    return g_script_clock ? g_script_clock : now_ns() / 1000;
+}
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 61)
+
+/**
+ * HDR 风格的对数-线性直方图：每个 2 的幂区间再分成 16 个子区间，
+ * 相对误差不超过 1/16，记录一个值只需要一次 clz
+ */
+typedef struct {
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    uint64_t commands; // 执行的指令数
+    uint64_t rejected; // 被拒绝或丢弃的指令数（例如 contact >= max_contacts）
+    uint64_t frames; // 提交的帧数
+    uint64_t events; // 写入的事件数
+    uint64_t writes; // write() 调用次数
+    uint64_t short_writes; // 没有一次写完的 write() 次数
+    uint64_t write_errors; // 失败的 write() 次数
+    histogram_t latency_us; // 从读到指令到 write() 返回的时间（微秒）
+    histogram_t frame_cost_ns; // 从帧的第一条指令开始执行到 write() 返回的时间（纳秒）
+    histogram_t events_per_frame;
+    histogram_t commands_per_frame;
+} stats_t;
+
+static stats_t g_stats;
+static volatile sig_atomic_t g_dump_stats = 0;
+
+static int histogram_index(uint64_t value) {
+    int shift = 0;
+
+    if (value >= 2 * HISTOGRAM_SUB_BUCKETS) {
+        shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    }
+
+    return HISTOGRAM_SUB_BUCKETS * shift + (int) (value >> shift);
+}
+
+static uint64_t histogram_value(int index) {
+    int shift = index < 2 * HISTOGRAM_SUB_BUCKETS ? 0 : index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t) (index - HISTOGRAM_SUB_BUCKETS * shift) << shift;
+
+    // Report the middle of the bucket.
+    return low + ((1ULL << shift) >> 1);
+}
+
+static void histogram_record(histogram_t *histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)] += 1;
+    histogram->total += 1;
+
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+static uint64_t histogram_percentile(const histogram_t *histogram, double percentile) {
+    uint64_t target = (uint64_t) (histogram->total * percentile / 100 + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+
+        if (seen >= target) {
+            uint64_t value = histogram_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+static int format_histogram(char *buffer, size_t size, const char *name, const histogram_t *histogram) {
+    return snprintf(buffer, size, " %s_p50=%llu %s_p90=%llu %s_p99=%llu %s_max=%llu",
+                    name, (unsigned long long) histogram_percentile(histogram, 50),
+                    name, (unsigned long long) histogram_percentile(histogram, 90),
+                    name, (unsigned long long) histogram_percentile(histogram, 99),
+                    name, (unsigned long long) histogram->max);
+}
+
+/**
+ * 将统计信息格式化为一行 "s key=value ..."
+ * @param buffer
+ * @param size
+ * @return 写入的长度
+ */
+static int format_stats(char *buffer, size_t size) {
+    int length = snprintf(buffer, size,
+                          "s commands=%llu rejected=%llu frames=%llu events=%llu"
+                          " writes=%llu short_writes=%llu write_errors=%llu",
+                          (unsigned long long) g_stats.commands,
+                          (unsigned long long) g_stats.rejected,
+                          (unsigned long long) g_stats.frames,
+                          (unsigned long long) g_stats.events,
+                          (unsigned long long) g_stats.writes,
+                          (unsigned long long) g_stats.short_writes,
+                          (unsigned long long) g_stats.write_errors);
+
+    length += format_histogram(buffer + length, size - length, "latency_us", &g_stats.latency_us);
+    length += format_histogram(buffer + length, size - length, "frame_cost_ns",
+                               &g_stats.frame_cost_ns);
+    length += format_histogram(buffer + length, size - length, "events_per_frame",
+                               &g_stats.events_per_frame);
+    length += format_histogram(buffer + length, size - length, "commands_per_frame",
+                               &g_stats.commands_per_frame);
+    length += snprintf(buffer + length, size - length, "\n");
+
+    return length;
+}
+
+static void on_dump_stats_signal(int signum) {
+    g_dump_stats = 1;
+}
+
+/**
+ * 收到 SIGUSR1 后在主循环中输出统计信息
+ */
+static void dump_stats_if_requested(void) {
+    char buffer[1536];
+
+    if (g_dump_stats) {
+        g_dump_stats = 0;
+        fputs(format_stats(buffer, sizeof(buffer)) > 0 ? buffer : "", stderr);
+    }
+}
+
+#define WRITE_EVENT(state, type, code, value) _write_event(state, type, #type, code, #code, value)
+
+/**
+ * 将当前帧追加到内存中的 capture 缓冲
+ * @param state
+ * @return 0 成功，-1 内存不足
+ */
+static int capture_frame(internal_state_touchpad_t *state) {
+    size_t needed = state->capture_len + state->frame_len;
+    size_t size = state->capture_size ? state->capture_size : 4096;
+    struct input_event *events;
+
+    if (needed > state->capture_size) {
+        while (size < needed) {
+            size *= 2;
+        }
+
+        events = realloc(state->capture, size * sizeof(*events));
+
+        if (events == NULL) {
+            return -1;
+        }
+
+        state->capture = events;
+        state->capture_size = size;
+    }
+
+    memcpy(&state->capture[state->capture_len], state->frame,
+           state->frame_len * sizeof(struct input_event));
+    state->capture_len = needed;
+    state->frame_len = 0;
+
+    return 0;
+}
+
+/**
+ * 将一组事件写入设备，被信号打断或只写入一部分时继续写完
+ * @param state
+ * @param events
+ * @param count
+ * @return 0 成功，-1 写入失败
+ */
+static int write_events(internal_state_touchpad_t *state, const struct input_event *events, size_t count) {
+    const char *cursor = (const char *) events;
+    size_t length = count * sizeof(struct input_event);
+    ssize_t result;
+
+    while (length > 0) {
+        result = write(state->fd, cursor, length);
+        g_stats.writes += 1;
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            g_stats.write_errors += 1;
+            perror("write");
+            return -1;
+        }
+
+        if ((size_t) result < length) {
+            g_stats.short_writes += 1;
+        }
+
+        // evdev only consumes whole events, so a short write always ends on
+        // an event boundary and we can simply continue with the rest.
+        cursor += result;
+        length -= result;
+    }
+
+    return 0;
+}
+
+/**
+ * 将当前帧缓存的事件一次性写入设备
+ * @param state
+ * @return 0 成功，-1 写入失败（帧会被丢弃）
+ */
+static int flush_frame(internal_state_touchpad_t *state) {
+    size_t count = state->frame_len;
+
+    if (state->capturing) {
+        return capture_frame(state);
+    }
+
+    state->frame_len = 0;
+
+    return write_events(state, state->frame, count);
+}
+
+static int _write_event(internal_state_touchpad_t *state,
+                        uint16_t type, const char *type_name,
+                        uint16_t code, const char *code_name,
+                        int32_t value) {
+    // It seems that most devices do not require the event timestamps at all.
+    // Left here for reference should such a situation arise.
+    //
+    //   timespec ts;
+    //   clock_gettime(CLOCK_MONOTONIC, &ts);
+    //   input_event event = {{ts.tv_sec, ts.tv_nsec / 1000}, type, code, value};
+
+    struct input_event event = {{0, 0}, type, code, value}; //对 input_event 进行赋值
+
+    if (g_verbose)
+        fprintf(stderr, "%-12s %-20s %08x\n", type_name, code_name, value); //输出日志
+
+    // The frame is only written out on commit. Should a misbehaving client
+    // overflow it, push out what we have so far rather than losing events.
+    if (state->frame_len == MAX_FRAME_EVENTS && flush_frame(state) < 0) {
+        return -1;
+    }
+
+    state->frame[state->frame_len++] = event; //追加到当前帧
+    state->frame_events += 1;
+    g_stats.events += 1;
+    return 0;
+}
+
+/**
+ * 写出当前帧并记录统计信息
+ * @param state
+ * @return
+ */
+static int finish_frame(internal_state_touchpad_t *state) {
+    int result = flush_frame(state);
+
+    g_stats.frames += 1;
+    histogram_record(&g_stats.events_per_frame, state->frame_events);
+    histogram_record(&g_stats.commands_per_frame, state->frame_commands);
+
+    if (state->frame_received != 0) {
+        histogram_record(&g_stats.latency_us, now_us() - state->frame_received);
+    }
+
+    if (state->frame_started != 0) {
+        histogram_record(&g_stats.frame_cost_ns, now_ns() - state->frame_started);
+    }
+
+    state->frame_events = 0;
+    state->frame_commands = 0;
+    state->frame_received = 0;
+    state->frame_started = 0;
+
+    return result;
+}
+
+static int next_tracking_id(internal_state_touchpad_t *state) {
     if (state->tracking_id < INT_MAX) {
         state->tracking_id += 1;
     } else {
@@ -421,11 +1275,65 @@ static int next_tracking_id(internal_state_touchpad_t *state) {
     return state->tracking_id;
 }
 
+/**
+ * 按已写入设备的值重复一个仍按下、但本帧的改动还没有提交的触控点
+ * @param state
+ * @param contact
+ */
+static void type_a_write_sent(internal_state_touchpad_t *state, int contact) {
+    contact_t *touch = &state->contacts[contact];
+
+    if (state->has_tracking_id)
+        WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+
+    if (state->has_touch_major)
+        WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+
+    if (state->has_width_major)
+        WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+
+    if (state->has_pressure)
+        WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, touch->sent_pressure);
+
+    WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, touch->sent_x);
+    WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, touch->sent_y);
+
+    WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+}
+
 static int type_a_commit(internal_state_touchpad_t *state) {
     int contact;
     int found_any = 0;
+    int changed_any = 0;
 
+    // Protocol A has to repeat every held contact in full each frame, or
+    // the reader takes it as lifted. So a frame is either sent complete or,
+    // if no committed contact changed since the last one, not at all.
     for (contact = 0; contact < state->max_contacts; ++contact) {
+        if (state->contacts[contact].owner == NULL &&
+            (state->contacts[contact].enabled == 1 || state->contacts[contact].enabled == 3 ||
+             state->contacts[contact].changed)) {
+            changed_any = 1;
+            break;
+        }
+    }
+
+    for (contact = 0; changed_any && contact < state->max_contacts; ++contact) {
+        if (state->contacts[contact].owner != NULL) {
+            // Another client's changes wait for its own commit, until then
+            // the contact stays as the device last saw it.
+            if (state->contacts[contact].enabled == 2 || state->contacts[contact].enabled == 3) {
+                found_any = 1;
+                type_a_write_sent(state, contact);
+            }
+            continue;
+        }
+
+        state->contacts[contact].changed = 0;
+        state->contacts[contact].sent_x = state->contacts[contact].x;
+        state->contacts[contact].sent_y = state->contacts[contact].y;
+        state->contacts[contact].sent_pressure = state->contacts[contact].pressure;
+
         switch (state->contacts[contact].enabled) { //判断 enabled不为0
             case 1: // WENT_DOWN
                 found_any = 1;
@@ -497,13 +1405,17 @@ static int type_a_commit(internal_state_touchpad_t *state) {
     if (found_any)
         WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
 
+    finish_frame(state);
+
     return 1;
 }
 
-static int type_a_touch_panic_reset_all(internal_state_touchpad_t *state) {
+static void type_a_touch_release_all(internal_state_touchpad_t *state) {
     int contact;
 
     for (contact = 0; contact < state->max_contacts; ++contact) {
+        state->contacts[contact].owner = NULL;
+
         switch (state->contacts[contact].enabled) {
             case 1: // WENT_DOWN
             case 2: // MOVED
@@ -512,6 +1424,10 @@ static int type_a_touch_panic_reset_all(internal_state_touchpad_t *state) {
                 break;
         }
     }
+}
+
+static int type_a_touch_panic_reset_all(internal_state_touchpad_t *state) {
+    type_a_touch_release_all(state);
 
     return type_a_commit(state);
 }
@@ -523,6 +1439,11 @@ type_a_touch_down(internal_state_touchpad_t *state, int contact, int x, int y, i
     }
 
     if (state->contacts[contact].enabled) {
+        // The reset would have to be written ahead of the held -P frame.
+        if (state->frame_held) {
+            return 0;
+        }
+
         type_a_touch_panic_reset_all(state);
     }
 
@@ -540,7 +1461,15 @@ type_a_touch_move(internal_state_touchpad_t *state, int contact, int x, int y, i
         return 0;
     }
 
-    state->contacts[contact].enabled = 2;
+    if (state->contacts[contact].enabled == 3) {
+        return 0;
+    }
+
+    if (state->contacts[contact].x != x || state->contacts[contact].y != y ||
+        state->contacts[contact].pressure != pressure) {
+        state->contacts[contact].changed = 1;
+    }
+
     state->contacts[contact].x = x;
     state->contacts[contact].y = y;
     state->contacts[contact].pressure = pressure;
@@ -549,33 +1478,134 @@ type_a_touch_move(internal_state_touchpad_t *state, int contact, int x, int y, i
 }
 
 static int type_a_touch_up(internal_state_touchpad_t *state, int contact) {
-    if (contact >= state->max_contacts || !state->contacts[contact].enabled) {
+    if (contact >= state->max_contacts || !state->contacts[contact].enabled ||
+        state->contacts[contact].enabled == 3) {
         return 0;
     }
 
-    state->contacts[contact].enabled = 3;
+    // Down and up within the same frame never reach the device at all.
+    state->contacts[contact].enabled = state->contacts[contact].enabled == 1 ? 0 : 3;
 
     return 1;
 }
 
+/**
+ * 写出一个触控点本帧的变化，没有变化的值不写
+ * @param state
+ * @param contact
+ */
+static void type_b_write_contact(internal_state_touchpad_t *state, int contact) {
+    contact_t *touch = &state->contacts[contact];
+
+    switch (touch->enabled) {
+        case 1: // WENT_DOWN
+            touch->tracking_id = next_tracking_id(state);
+            state->active_contacts += 1;
+
+            WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
+            WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, touch->tracking_id);
+
+            // Send BTN_TOUCH on first contact only.
+            if (state->active_contacts == 1 && state->has_key_btn_touch)
+                WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
+
+            if (state->has_touch_major)
+                WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+
+            if (state->has_width_major)
+                WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+
+            if (state->has_pressure)
+                WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, touch->pressure);
+
+            // A new contact always gets every value, the slot may have been
+            // used by the real driver in the meantime.
+            WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, touch->x);
+            WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, touch->y);
+
+            touch->enabled = 2;
+            break;
+        case 2: // MOVED
+            if (!touch->changed) {
+                return;
+            }
+
+            WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
+
+            if (state->has_pressure && touch->pressure != touch->sent_pressure)
+                WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, touch->pressure);
+
+            if (touch->x != touch->sent_x)
+                WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, touch->x);
+
+            if (touch->y != touch->sent_y)
+                WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, touch->y);
+            break;
+        case 3: // WENT_UP
+            state->active_contacts -= 1;
+
+            WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
+            WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, -1);
+
+            // Send BTN_TOUCH only when no contacts remain.
+            if (state->active_contacts == 0 && state->has_key_btn_touch)
+                WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+
+            touch->enabled = 0;
+            break;
+        default:
+            return;
+    }
+
+    touch->changed = 0;
+    touch->sent_x = touch->x;
+    touch->sent_y = touch->y;
+    touch->sent_pressure = touch->pressure;
+}
+
 static int type_b_commit(internal_state_touchpad_t *state) {
-    WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
+    int contact;
+
+    // Events are only generated here, from the final state of each contact,
+    // so repeated moves within a frame collapse into one. Slots another
+    // client hasn't committed yet are left for its own 'c'.
+    for (contact = 0; contact < state->max_contacts; ++contact) {
+        if (state->contacts[contact].owner == NULL) {
+            type_b_write_contact(state, contact);
+        }
+    }
+
+    if (state->frame_events > 0)
+        WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
+
+    finish_frame(state);
 
     return 1;
 }
 
-static int type_b_touch_panic_reset_all(internal_state_touchpad_t *state) {
+static int type_b_touch_release_all(internal_state_touchpad_t *state) {
     int contact;
     int found_any = 0;
 
     for (contact = 0; contact < state->max_contacts; ++contact) {
-        if (state->contacts[contact].enabled) {
-            state->contacts[contact].enabled = 0;
-            found_any = 1;
+        state->contacts[contact].owner = NULL;
+
+        switch (state->contacts[contact].enabled) {
+            case 1: // WENT_DOWN, never sent
+                state->contacts[contact].enabled = 0;
+                break;
+            case 2: // MOVED
+                state->contacts[contact].enabled = 3;
+                found_any = 1;
+                break;
         }
     }
 
-    return found_any ? type_b_commit(state) : 1;
+    return found_any;
+}
+
+static int type_b_touch_panic_reset_all(internal_state_touchpad_t *state) {
+    return type_b_touch_release_all(state) ? type_b_commit(state) : 1;
 }
 
 static int
@@ -584,75 +1614,61 @@ type_b_touch_down(internal_state_touchpad_t *state, int contact, int x, int y, i
         return 0;
     }
 
-    if (state->contacts[contact].enabled) {
+    if (state->contacts[contact].enabled && state->frame_held) {
+        // Both cases below write a frame, which must wait for the held one.
+        return 0;
+    }
+
+    if (state->contacts[contact].enabled == 3) {
+        // Lifted earlier in this frame, let that reach the device first.
+        state->contacts[contact].owner = NULL;
+        type_b_commit(state);
+    } else if (state->contacts[contact].enabled) {
         type_b_touch_panic_reset_all(state);
     }
 
     state->contacts[contact].enabled = 1;
-    state->contacts[contact].tracking_id = next_tracking_id(state);
-    state->active_contacts += 1;
-
-    WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
-    WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID,
-                state->contacts[contact].tracking_id);
-
-    // Send BTN_TOUCH on first contact only.
-    if (state->active_contacts == 1 && state->has_key_btn_touch)
-        WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
-
-    if (state->has_touch_major)
-        WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
-
-    if (state->has_width_major)
-        WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
-
-    if (state->has_pressure)
-        WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, pressure);
-
-    WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, x);
-    WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, y);
+    state->contacts[contact].x = x;
+    state->contacts[contact].y = y;
+    state->contacts[contact].pressure = pressure;
 
     return 1;
 }
 
 static int
 type_b_touch_move(internal_state_touchpad_t *state, int contact, int x, int y, int pressure) {
-    if (contact >= state->max_contacts || !state->contacts[contact].enabled) {
+    contact_t *touch;
+
+    if (contact >= state->max_contacts) {
         return 0;
     }
 
-    WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
+    touch = &state->contacts[contact];
 
-    if (state->has_touch_major)
-        WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
-
-    if (state->has_width_major)
-        WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+    if (!touch->enabled || touch->enabled == 3) {
+        return 0;
+    }
 
-    if (state->has_pressure)
-        WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, pressure);
+    touch->x = x;
+    touch->y = y;
+    touch->pressure = pressure;
 
-    WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, x);
-    WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, y);
+    if (touch->enabled == 2) {
+        touch->changed = x != touch->sent_x || y != touch->sent_y ||
+                         pressure != touch->sent_pressure;
+    }
 
     return 1;
 }
 
 static int type_b_touch_up(internal_state_touchpad_t *state, int contact) {
-    if (contact >= state->max_contacts || !state->contacts[contact].enabled) {
+    if (contact >= state->max_contacts || !state->contacts[contact].enabled ||
+        state->contacts[contact].enabled == 3) {
         return 0;
     }
 
-    state->contacts[contact].enabled = 0;
-    state->contacts[contact].enabled = 0;
-    state->active_contacts -= 1;
-
-    WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
-    WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, -1);
-
-    // Send BTN_TOUCH only when no contacts remain.
-    if (state->active_contacts == 0 && state->has_key_btn_touch)
-        WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+    // Down and up within the same frame never reach the device at all.
+    state->contacts[contact].enabled = state->contacts[contact].enabled == 1 ? 0 : 3;
 
     return 1;
 }
@@ -681,6 +1697,18 @@ static int touch_up(internal_state_touchpad_t *state, int contact) {
     }
 }
 
+/**
+ * 抬起全部触控点，但不提交
+ * @param state
+ */
+static void touch_release_all(internal_state_touchpad_t *state) {
+    if (state->has_mtslot) {
+        type_b_touch_release_all(state);
+    } else {
+        type_a_touch_release_all(state);
+    }
+}
+
 static int touch_panic_reset_all(internal_state_touchpad_t *state) {
     if (state->has_mtslot) {
         return type_b_touch_panic_reset_all(state);
@@ -723,476 +1751,4603 @@ static int start_server(char *sockname) {
         return -1;
     }
 
-    listen(fd, 1); //监听socket端口
+    listen(fd, MAX_CLIENTS); //监听socket端口
 
     return fd;
 }
 
-static void parse_input(char *buffer, internal_state_touchpad_t *state) {
-    char *cursor;
-    long int contact, x, y, pressure, wait;
+/**
+ * 开启 TCP 监听，主机可以直接连接，不必经过 adb forward
+ * @param spec [address:]port，省略 address 时只监听 127.0.0.1
+ * @return 监听的 fd，失败时返回 -1
+ */
+static int start_tcp_server(const char *spec) {
+    struct sockaddr_in addr;
+    char address[INET_ADDRSTRLEN] = "127.0.0.1";
+    const char *colon = strrchr(spec, ':');
+    const char *port = colon != NULL ? colon + 1 : spec;
+    char *end;
+    long number;
+    int reuse = 1;
+    int fd;
 
-    cursor = (char *) buffer; //对指针进行遍历
-    cursor += 1;
+    if (colon != NULL) {
+        if ((size_t) (colon - spec) >= sizeof(address)) {
+            fprintf(stderr, "Invalid address '%s'\n", spec);
+            return -1;
+        }
+
+        memcpy(address, spec, colon - spec);
+        address[colon - spec] = 0;
+    }
+
+    number = strtol(port, &end, 10);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) number);
+
+    if (*port == 0 || *end != 0 || number <= 0 || number > 65535 ||
+        inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address '%s'\n", spec);
+        return -1;
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("creating tcp socket");
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("binding tcp socket");
+        close(fd);
+        return -1;
+    }
+
+    listen(fd, MAX_CLIENTS);
+
+    return fd;
+}
+
+/**
+ * 解析后的单条指令，文本协议和二进制协议最终都会被解码成这个结构
+ */
+typedef struct {
+    char op; // 'c' 'r' 'd' 'm' 'u' 'w' 't' 'T'
+    long int contact;
+    long int x;
+    long int y;
+    long int pressure;
+    int64_t wait; // 'w' 't' 'T' 的等待时间（微秒）
+    uint64_t received; // 指令读取（或等待结束）的时间（微秒），用于统计延迟，0 表示未知
+} command_t;
+
+/**
+ * 提交当前帧。使用 -P 时离上一帧太近的帧先推迟，由 serve() 在 pace_next 写出
+ * @param state
+ */
+static void paced_commit(internal_state_touchpad_t *state) {
+    if (state->pace_period != 0 && (state->frame_held || now_ns() < state->pace_next)) {
+        state->frame_held = 1;
+        return;
+    }
+
+    if (state->pace_period != 0) {
+        state->pace_next = now_ns() + state->pace_period;
+    }
+
+    commit(state);
+}
+
+static void apply_command(const command_t *command, internal_state_touchpad_t *state) {
+    int accepted = 1;
 
     //Linux内核多点触控协议 https://www.kernel.org/doc/Documentation/input/multi-touch-protocol.txt
-    switch (buffer[0]) { //取缓冲行的第一个字符，进行分支判断
+    switch (command->op) {
         case 'c': // COMMIT
-            commit(state);
+            paced_commit(state);
             break;
         case 'r': // RESET
-            touch_panic_reset_all(state);
+            touch_release_all(state);
+            paced_commit(state);
             break;
         case 'd': // TOUCH DOWN
-            contact = strtol(cursor, &cursor, 10); //strtol : string to long
-            x = strtol(cursor, &cursor, 10);
-            y = strtol(cursor, &cursor, 10);
-            pressure = strtol(cursor, &cursor, 10);
-            touch_down(state, contact, x, y, pressure);
+            accepted = touch_down(state, command->contact, command->x, command->y, command->pressure);
             break;
         case 'm': // TOUCH MOVE
-            contact = strtol(cursor, &cursor, 10);
-            x = strtol(cursor, &cursor, 10);
-            y = strtol(cursor, &cursor, 10);
-            pressure = strtol(cursor, &cursor, 10);
-            touch_move(state, contact, x, y, pressure);
+            accepted = touch_move(state, command->contact, command->x, command->y, command->pressure);
             break;
         case 'u': // TOUCH UP
-            contact = strtol(cursor, &cursor, 10);
-            touch_up(state, contact);
-            break;
-        case 'w':
-            wait = strtol(cursor, &cursor, 10);
-            if (g_verbose)
-                fprintf(stderr, "Waiting %ld ms\n", wait);
-            usleep(wait * 1000);
+            accepted = touch_up(state, command->contact);
             break;
         default:
+            accepted = 0;
             break;
     }
-}
-
-static void io_handler(FILE *input, FILE *output, internal_state_touchpad_t *state) {
-    // setvbuf函数
-    // 第一个参数为流
-    // 第二个参数为NULL，分配一个指定大小的缓冲
-    // 第三个参数_IOLBF表示行缓冲，第四个参数指定缓冲的大小
-    setvbuf(input, NULL, _IOLBF, 1024);
-    setvbuf(output, NULL, _IOLBF, 1024);
 
-    // Tell version
-    fprintf(output, "v %d\n", VERSION);
+    g_stats.commands += 1;
 
-    // Tell limits
-    fprintf(output, "^ %d %d %d %d\n",
-            state->max_contacts, state->max_x, state->max_y, state->max_pressure);
+    if (!accepted) {
+        g_stats.rejected += 1;
+        return;
+    }
 
-    // Tell pid
-    fprintf(output, "$ %d\n", getpid());
+    if (command->op != 'c' && command->op != 'r') {
+        if (state->frame_commands == 0) {
+            state->frame_started = now_ns();
+        }
 
-    char read_buffer[80]; //用于读取input数据的缓冲字符数组
+        state->frame_commands += 1;
 
-    while (fgets(read_buffer, sizeof(read_buffer), input) != NULL) { //fgets函数功能为从指定的流中读取数据，每次读取一行
-        read_buffer[strcspn(read_buffer, "\r\n")] = 0; //按行读取缓冲数据
-        parse_input(read_buffer, state); //解析缓冲数据
+        if (command->received != 0 &&
+            (state->frame_received == 0 || command->received < state->frame_received)) {
+            state->frame_received = command->received;
+        }
     }
 }
 
-static void
-print_event(struct input_event *ev,internal_state_touchpad_t *stateTouchpad) {
-    if (ev->type == EV_SYN){
-        commit(stateTouchpad);
-        fprintf(stderr, "Event: time %ld.%06ld, ++++++++++++++++++++ %s +++++++++++++++\n",
-                ev->time.tv_sec,
-                ev->time.tv_usec,
-                libevdev_event_type_get_name(ev->type));
-    }else{
-        mappingKeyboardEvent(ev,stateTouchpad);
-        fprintf(stderr, "Event: time %ld.%06ld, type %d (%s), code %d (%s), value %d\n",
-                ev->time.tv_sec,
-                ev->time.tv_usec,
-                ev->type,
-                libevdev_event_type_get_name(ev->type),
-                ev->code,
-                libevdev_event_code_get_name(ev->type, ev->code),
-                ev->value);
-    }
-}
+static void parse_input(char *buffer, command_t *command) {
+    char *cursor;
 
-static void
-print_sync_event(struct input_event *ev,internal_state_touchpad_t *stateKeyboard) {
-    printf("SYNC: ");
-    print_event(ev,stateKeyboard);
-}
+    cursor = (char *) buffer; //对指针进行遍历
+    cursor += 1;
 
-/**
- * 监听键盘输入信息
- * @param rc
- * @param state_keyboard
- * @return
- */
-static void
-listen_keyboard_input(internal_state_warper warper) {
-    internal_state_keyboard_t state_keyboard = warper.keyboard;
-    internal_state_touchpad_t state_touchpad = warper.touchpad;
-
-    int id = pthread_self();
-    printf("Thread ID: %x\n", id);
-    int rc = 1;
-    do {
-        struct input_event ev;
-        rc = libevdev_next_event(state_keyboard.evdev,
-                                 LIBEVDEV_READ_FLAG_NORMAL | LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-            printf("::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
-            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-                if (g_verbose) {
-                    print_sync_event(&ev,&state_touchpad);
-                }
-                rc = libevdev_next_event(state_keyboard.evdev, LIBEVDEV_READ_FLAG_SYNC, &ev);
-            }
-            printf("::::::::::::::::::::: re-synced ::::::::::::::::::::::\n");
-        } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS)
-            print_event(&ev,&state_touchpad);
-    } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS ||
-             rc == -EAGAIN);
-}
+    memset(command, 0, sizeof(*command));
 
-static void mappingKeyboardEvent(struct input_event *pEvent, internal_state_touchpad_t *stateTouchpad) {
-    //当触发指定按键时，发送相应的多点触控指令，可以做一个WASD画圆的sample
-    fprintf(stderr,"mappingKeyboardEvent...");
-    int action = pEvent->value;
-    fprintf(stderr,"action:%d",action);
-    switch (action) {
-        case 0: //action_up
-            dealWithActionUp(pEvent, stateTouchpad);
+    command->op = buffer[0]; //取缓冲行的第一个字符，进行分支判断
+    switch (command->op) {
+        case 'd': // TOUCH DOWN
+        case 'm': // TOUCH MOVE
+            command->contact = strtol(cursor, &cursor, 10); //strtol : string to long
+            command->x = strtol(cursor, &cursor, 10);
+            command->y = strtol(cursor, &cursor, 10);
+            command->pressure = strtol(cursor, &cursor, 10);
             break;
-        case 1://action_down
-            dealWithActionDown(pEvent, stateTouchpad);
+        case 'u': // TOUCH UP
+        case 'D': // SELECT TOUCH DEVICE
+            command->contact = strtol(cursor, &cursor, 10);
+            break;
+        case 'w': // WAIT (ms)
+            command->wait = (int64_t) strtol(cursor, &cursor, 10) * 1000;
+            break;
+        case 't': // WAIT (us)
+        case 'T': // WAIT UNTIL (us)
+            command->wait = strtoll(cursor, &cursor, 10);
             break;
     }
 }
 
+#define BINARY_RECORD_SIZE 16
 
-static void dealWithActionUp(struct input_event *pEvent, internal_state_touchpad_t *touchpad) {
-    // 定义AS的映射点（可以做成可配置的选项）
-    int key_code = pEvent->code;
-    switch (key_code) {
-        case KEY_A:
-            // 触发A对应点的按下事件
-            touch_up(touchpad, 0);
-            break;
-        case KEY_D:
-            //触发B对应点的按下事件
-            touch_up(touchpad, 1);
-            break;
+static int32_t read_le32(const unsigned char *p) {
+    return (int32_t) ((uint32_t) p[0] | (uint32_t) p[1] << 8 |
+                      (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+}
+
+/**
+ * 解析二进制协议的一条记录（小端序，固定 16 字节）
+ *
+ *   offset 0  uint8   opcode，与文本协议的命令字母相同
+ *   offset 1  uint8   contact
+ *   offset 2  uint16  pressure
+ *   offset 4  int32   x
+ *   offset 8  int32   y
+ *   offset 12 uint32  wait（'w' 为毫秒，'t' 'T' 为微秒）
+ */
+static void parse_binary_input(const unsigned char *record, command_t *command) {
+    command->op = (char) record[0];
+    command->contact = record[1];
+    command->pressure = record[2] | record[3] << 8;
+    command->x = read_le32(&record[4]);
+    command->y = read_le32(&record[8]);
+    command->wait = (uint32_t) read_le32(&record[12]);
+
+    if (command->op == 'w') {
+        command->wait *= 1000;
     }
 }
 
+typedef struct {
+    uint64_t sequence; // 等于写入位置时可写，等于写入位置 + 1 时可读
+    command_t command;
+} command_cell_t;
 
 /**
- * 处理按下事件
- * @param pEvent
- * @param touchpad
- */
-static void dealWithActionDown(struct input_event *pEvent, internal_state_touchpad_t *touchpad) {
-    // 定义AS的映射点（可以做成可配置的选项）
-    int pointer_A[2] = {230, 491};
-    int pointer_S[2] = {230, 732};
-    int key_code = pEvent->code;
-    switch (key_code) {
-        case KEY_A:
-            // 触发A对应点的按下事件
-            touch_down(touchpad, 0, pointer_A[0], pointer_A[1], 10);
-            break;
-        case KEY_D:
-            // 触发D对应点的按下事件
-            touch_down(touchpad, 1, pointer_S[0], pointer_S[1], 10);
-            break;
+ * 多生产者单消费者的无锁指令队列（有界环形缓冲区）
+ *
+ * 输入线程等其他线程把指令放进来，只有注入线程（serve 所在线程）取出并执行，
+ * 因此触控状态和设备 fd 只会被一个线程访问。取出一侧不需要原子操作，
+ * 放入一侧通过 CAS 竞争 tail。放入后需要调用 command_queue_notify 唤醒注入线程。
+ */
+typedef struct {
+    command_cell_t cells[COMMAND_QUEUE_SIZE];
+    uint64_t tail __attribute__ ((aligned(64))); // 下一个写入位置，生产者共享
+    uint64_t head __attribute__ ((aligned(64))); // 下一个读取位置，只有消费者访问
+    int event_fd; // 有新指令时写入，注入线程用 epoll 等待
+} command_queue_t;
+
+static command_queue_t g_commands;
+
+static int command_queue_init(command_queue_t *queue) {
+    uint64_t i;
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; ++i) {
+        queue->cells[i].sequence = i;
     }
+
+    queue->head = 0;
+    queue->tail = 0;
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    return queue->event_fd;
 }
 
+/**
+ * 放入一条指令，可以在任意线程调用
+ * @param queue
+ * @param command
+ * @return 0 成功，-1 队列已满
+ */
+static int command_queue_push(command_queue_t *queue, const command_t *command) {
+    uint64_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    command_cell_t *cell;
 
+    for (;;) {
+        cell = &queue->cells[pos & (COMMAND_QUEUE_SIZE - 1)];
+        int64_t diff = (int64_t) (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
 
-char* strJoin(char *s1, char *s2)
-{
-    char *result = malloc(strlen(s1)+strlen(s2)+1);//+1 for the zero-terminator
-    if(result==NULL){
-        return "";
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
     }
-    strcpy(result, s1);
-    strcat(result, s2);
-    return result;
+
+    cell->command = *command;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
 }
 
+/**
+ * 取出一条指令，只能在注入线程调用
+ * @param queue
+ * @param command
+ * @return 1 取到指令，0 队列为空
+ */
+static int command_queue_pop(command_queue_t *queue, command_t *command) {
+    command_cell_t *cell = &queue->cells[queue->head & (COMMAND_QUEUE_SIZE - 1)];
 
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != queue->head + 1) {
+        return 0;
+    }
 
-static void
-on_device_added(internal_state_warper warper, struct inotify_event *pEvent, char *val) {
-    // 有新设备添加时，应该判断event是否为键盘设备
-    char *name = pEvent->name;
-    char *root_path = "dev/input/";
-    char *dev_path = strJoin(root_path,name);
-    fprintf(stderr,"on device added:%s,",dev_path);
-    consider_keyboard_device(dev_path,&warper.keyboard);
-    if(warper.keyboard.evdev){ //找到设备
-        fprintf(stderr,"and it's keyboard device\n");
-        pthread_t keyboardThread;
-        pthread_create(&keyboardThread, NULL, (void *) &listen_keyboard_input, (void *) &warper);
-    } else{ //未找到设备
-        fprintf(stderr,"but it's not a keyboard kevice\n");
-    }
-}
-
-static void on_device_removed(struct inotify_event *pEvent, char *val) {
-    //有设备移除
+    *command = cell->command;
+    __atomic_store_n(&cell->sequence, queue->head + COMMAND_QUEUE_SIZE, __ATOMIC_RELEASE);
+    queue->head += 1;
 
+    return 1;
 }
 
+/**
+ * 唤醒注入线程处理新放入的指令
+ * @param queue
+ */
+static void command_queue_notify(command_queue_t *queue) {
+    uint64_t one = 1;
 
+    write(queue->event_fd, &one, sizeof(one));
+}
 
 /**
- * 使用inotify方式对文件变化进行监听
+ * 精确等待到指定时间：先睡眠，最后 SPIN_WAIT_US 微秒忙等
+ * @param deadline CLOCK_MONOTONIC 微秒
  */
-static void watch_inotify(internal_state_warper warper) {
-    int fd;
-    int wd;
-    int len;
-    int nread;
-    char buf[BUFSIZ];
-    struct inotify_event *event;
-    int i;
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = now_us();
 
-    fd = inotify_init();
-    if (fd < 0) {
-        fprintf(stderr, "inotify_init failed\n");
+    if (deadline > now + SPIN_WAIT_US) {
+        usleep(deadline - now - SPIN_WAIT_US);
     }
 
-    wd = inotify_add_watch(fd, "dev/input", (IN_CREATE | IN_DELETE)); //对 dev/input 这个目录进行监听，监听两个事件：IN_CREATE和IN_DELETE
-    if (wd < 0) {
-        fprintf(stderr, "inotify_add_watch %s failed\n", "dev/input");
-    }
+    // The last stretch is spun out, sleeping overshoots by far too much.
+    while (now_us() < deadline);
+}
 
-    fprintf(stderr,">>> watching device state change...\n");
+enum {
+    GESTURE_NONE,
+    GESTURE_LINEAR, // swipe、fling：触控点沿直线移动
+    GESTURE_POLAR, // pinch、rotate：两个触控点绕中心对称，半径和角度随时间变化
+};
 
-    buf[sizeof(buf) - 1] = 0;
-    while ((len = read(fd, buf, sizeof(buf) - 1)) > 0) {
-        nread = 0;
-        while (len > 0) {
-            event = (struct inotify_event *) &buf[nread];
-            for (i = 0; i < EVENT_NUM; i++) {
-                if ((event->mask >> i) & 1) {
-                    if (event->len > 0) {
-
-                        char *eventVal = event_str[i];
-                        fprintf(stdout, "%s --- %s\n", event->name, eventVal);
-                        if (strcmp(eventVal,"IN_CREATE") == 0) {
-                            fprintf(stdout, "on device added: %s --- %s\n", event->name, eventVal);
-                            on_device_added(warper,event,eventVal);//有设备添加
-                        }else if (strcmp(eventVal, "IN_DELETE")==0) {
-                            fprintf(stdout, "on device removed: %s --- %s\n", event->name, eventVal);
-                            on_device_removed(event,eventVal);//有设备移除
-                        }
-                    } else {
-                        fprintf(stdout, "%s --- %s\n", " ", event_str[i]);
-                    }
-                }
-            }
-            nread = nread + sizeof(struct inotify_event) + event->len;
-            len = len - sizeof(struct inotify_event) - event->len;
-        }
-    }
-}
+enum {
+    EASE_LINEAR,
+    EASE_IN,
+    EASE_OUT,
+    EASE_IN_OUT,
+};
 
+typedef struct {
+    int kind; // GESTURE_*，GESTURE_NONE 表示当前没有进行中的手势
+    int easing; // EASE_*
+    int count; // 参与手势的触控点数（1 或 2）
+    int contacts[2]; // 客户端的逻辑触控点
+    double x0, y0, x1, y1; // GESTURE_LINEAR 的起点和终点
+    double cx, cy, r0, r1, a0, a1; // GESTURE_POLAR 的中心、起止半径和起止角度（弧度）
+    int pressure;
+    uint64_t start; // 手势开始时间（微秒）
+    uint64_t duration; // 手势持续时间（微秒）
+    int step; // 已经完成的步数
+    int steps; // 总步数，由帧率决定
+} gesture_t; //由 'g' 指令生成、在服务端按帧展开的手势
 
 /**
- * Warning: shell下无权限对该socket进行bind操作
- * 使用netLink对键盘的插入/拔出进行监听
+ * 客户端通过 'M' 指令交给 minitouch 的共享内存的开头，之后是 size 条二进制协议的记录。
+ * 客户端是唯一的生产者，写入记录后增加 head 并写 eventfd，minitouch 是唯一的消费者，
+ * 执行后增加 tail。两个计数器只增不减，下标为计数器 & (size - 1)
  */
-static void monitorNetlinkUevent() {
-    int sockfd;
-    struct sockaddr_nl sa;
-    int len;
-    char buf[4096];
-    struct iovec iov;
-    struct msghdr msg;
-    int i;
+typedef struct {
+    uint32_t magic; // RING_MAGIC
+    uint32_t size; // 记录数，必须是 2 的幂
+    uint64_t head __attribute__ ((aligned(64))); // 已写入的记录数，只有客户端修改
+    uint64_t tail __attribute__ ((aligned(64))); // 已执行的记录数，只有 minitouch 修改
+} ring_header_t;
+
+typedef struct {
+    ring_header_t *header; // NULL 表示没有共享内存队列
+    const unsigned char *records;
+    size_t length; // 映射的长度
+    uint64_t mask;
+    uint64_t tail; // tail 的本地副本
+    int event_fd; // 客户端写入新记录后的通知
+    int watched; // event_fd 是否已加入 epoll
+} ring_t;
+
+typedef struct {
+    int fd; //输入的文件描述符，-1 表示该客户端位置空闲
+    int output_fd; //握手信息等输出的文件描述符
+    int binary; //是否已切换到二进制协议
+    int closing; //输入已结束，执行完缓冲区中剩余的指令后关闭
+    int paused; //输入缓冲区已满，或回复积压过多，暂停从 fd 读取
+    int writing; //有尚未写出的回复，等待 output_fd 可写
+    int socket; //fd 是 unix socket，可以通过 SCM_RIGHTS 收到 fd
+    int ack; //是否在每次 'c' 提交后回复序号和写入时间
+    uint32_t commits; //已回复的提交数
+    uint32_t acks_held[MAX_TOUCH_DEVICES]; //各触控设备上提交的帧被 -P 推迟写出，尚未回复的提交数
+    int stalled; //held 无法合并进 -P 推迟的帧，等到该帧写出后再执行
+    command_t held;
+    int passed_fds[2]; //随数据收到、尚未被 'M' 取走的 fd
+    int passed_count;
+    ring_t ring; //'M' 指令映射的共享内存队列
+    char buffer[READ_BUFFER_SIZE]; //尚未解析的输入数据
+    char output[OUTPUT_BUFFER_SIZE]; //socket 暂时写不进去、尚未写出的回复
+    size_t output_len;
+    size_t start;
+    size_t end;
+    uint64_t origin; //连接建立的时间（微秒），'T' 的时间基准
+    uint64_t deadline; //下一条指令的执行时间（微秒）
+    int waiting; //是否正在等待 deadline
+    uint64_t received; //最近一次读到数据（或等待结束）的时间（微秒），用于统计延迟
+    gesture_t gesture; //进行中的手势，未结束前不执行后续指令
+    int device; //'D' 指令选择的触控设备，之后的指令都作用于它
+    int contacts[MAX_TOUCH_DEVICES][MAX_SUPPORTED_CONTACTS]; //各触控设备上，客户端的逻辑触控点 -> state->contacts 中实际槽位的映射，-1 表示未映射
+} client_t; //表示一个客户端连接的结构体
+
+static client_t g_clients[MAX_CLIENTS];
+
+// -A 额外打开的触控设备，编号从 1 开始，0 是 serve() 收到的主触控设备
+static internal_state_touchpad_t g_extra_touch_devices[MAX_TOUCH_DEVICES - 1];
+static int g_touch_device_count = 1;
 
-    memset(&sa, 0, sizeof(sa));
-    sa.nl_family = AF_NETLINK;
-    sa.nl_groups = NETLINK_KOBJECT_UEVENT;
-    sa.nl_pid = 0;//getpid(); both is ok
-    memset(&msg, 0, sizeof(msg));
-    iov.iov_base = (void *) buf;
-    iov.iov_len = sizeof(buf);
-    msg.msg_name = (void *) &sa;
-    msg.msg_namelen = sizeof(sa);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-
-    sockfd = socket(AF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
-    if (sockfd == -1)
-        printf("socket creating failed:%s\n", strerror(errno));
-    if (bind(sockfd, (struct sockaddr *) &sa, sizeof(sa)) == -1)
-        printf("bind error:%s\n", strerror(errno));
-
-    len = recvmsg(sockfd, &msg, 0);
-    if (len < 0)
-        printf("receive error\n");
-    else if (len < 32 || len > sizeof(buf))
-        printf("invalid message");
-    for (i = 0; i < len; i++)
-        if (*(buf + i) == '\0')
-            buf[i] = '\n';
-    fprintf(stderr, "received %d bytes\n%s\n", len, buf);
+/**
+ * 按编号取得触控设备
+ * @param state 主触控设备
+ * @param index
+ * @return
+ */
+static internal_state_touchpad_t *touch_device(internal_state_touchpad_t *state, int index) {
+    return index == 0 ? state : &g_extra_touch_devices[index - 1];
 }
 
-int main(int argc, char *argv[]) { //入口函数
-    const char *pname = argv[0];
-    const char *devroot = "/dev/input"; //设备的输入事件目录
-    char *device = NULL;
-    char *sockname = DEFAULT_SOCKET_NAME; //宏定义
-    char *stdin_file = NULL;
-    int use_stdin = 0;
+// 键盘等本地输入源共用的客户端，逻辑触控点与 socket 客户端一样映射到空闲槽位
+static client_t g_input_client;
 
-    int opt;
-    while ((opt = getopt(argc, argv, "d:n:vif:h")) != -1) { // 命令行参数
-        switch (opt) {
-            case 'd':
-                device = optarg;
-                break;
-            case 'n':
-                sockname = optarg;
-                break;
-            case 'v':
-                g_verbose = 1;
-                break;
-            case 'i':
-                use_stdin = 1;
-                break;
-            case 'f':
-                stdin_file = optarg;
+/**
+ * 写出客户端缓冲中的回复，写不进去的部分留到 output_fd 可写时再写
+ * @param client
+ * @return 0 已写完或暂时写不进去，-1 连接已不可用
+ */
+static int client_flush(client_t *client) {
+    size_t written = 0;
+    ssize_t result;
+
+    while (written < client->output_len) {
+        result = write(client->output_fd, &client->output[written], client->output_len - written);
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
                 break;
-            case '?':
-                usage(pname);
-                return EXIT_FAILURE;
-            case 'h':
-                usage(pname);
-                return EXIT_SUCCESS;
-        }
-    }
+            }
 
-    internal_state_touchpad_t state_touchpad = {0}; // 对触摸设备的结构体初始化
+            // Nobody is reading anymore, the read side will notice too.
+            client->output_len = 0;
+            return -1;
+        }
 
-    internal_state_keyboard_t state_keyboard = {0}; // 对键盘设备的结构体初始化
+        written += result;
+    }
 
-    //鼠标 如何判断是否是鼠标设备 x 3 y 3  结合业务需求  CS 转动视角  move（1920 1080）游戏  （0,0） move
+    memmove(client->output, &client->output[written], client->output_len - written);
+    client->output_len -= written;
 
+    return 0;
+}
 
-    //手柄 如何判断是否是手柄设备
+/**
+ * 按顺序向客户端写入一条回复。socket 写不进去时先缓冲，
+ * 缓冲也满了就关闭连接，而不是悄悄丢掉或截断回复
+ * @param client
+ * @param data
+ * @param length
+ */
+static void client_send(client_t *client, const char *data, size_t length) {
+    if (client->output_len > 0) {
+        client_flush(client);
+    }
 
+    if (length > sizeof(client->output) - client->output_len) {
+        fprintf(stderr, "Client isn't reading its replies, closing the connection\n");
+        client->output_len = 0;
 
-    //...
+        // The next read sees the end of the stream and cleans up as usual.
+        shutdown(client->output_fd, SHUT_RDWR);
+        return;
+    }
 
+    memcpy(&client->output[client->output_len], data, length);
+    client->output_len += length;
+    client_flush(client);
+}
 
-    internal_state_warper state_waper = {0, 0};  //包装结构体
+/**
+ * 客户端的回复是否积压过多，积压时暂停读取和执行它的指令，直到回复写出
+ * @param client
+ * @return
+ */
+static int client_backlogged(const client_t *client) {
+    return client->output_len >= sizeof(client->output) / 2;
+}
 
+/**
+ * 判断触控设备上的槽位是否已被某个客户端占用
+ * @param device
+ * @param slot
+ * @return
+ */
+static int is_slot_claimed(int device, int slot) {
+    int i;
+    int contact;
 
-    //程序第一次运行时，检测是否有可触控设备及键盘设备
-    if (device != NULL) { //指定设备
-        if (!consider_touch_device(device, &state_touchpad)) {  //判断触控设备是否可用
-            fprintf(stderr, "%s is not a supported touch device\n", device);
-            return EXIT_FAILURE;
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        if (g_clients[i].fd < 0) {
+            continue;
         }
-    } else { //非指定设备 //dev/input/eventX
-        if (walk_devices(devroot, &state_touchpad, &state_keyboard) != 0) {
-            fprintf(stderr, "Unable to crawl %s for touch devices\n", devroot);
-            return EXIT_FAILURE; //退出程序
+
+        for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+            if (g_clients[i].contacts[device][contact] == slot) {
+                return 1;
+            }
         }
     }
 
-    if (state_touchpad.evdev == NULL) {
-        fprintf(stderr, "Unable to find a suitable touch device\n");
-        return EXIT_FAILURE;
+    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+        if (g_input_client.contacts[device][contact] == slot) {
+            return 1;
+        }
     }
 
-    state_touchpad.has_mtslot =
-            libevdev_has_event_code(state_touchpad.evdev, EV_ABS, ABS_MT_SLOT);
-    state_touchpad.has_tracking_id =
-            libevdev_has_event_code(state_touchpad.evdev, EV_ABS, ABS_MT_TRACKING_ID);
-    state_touchpad.has_key_btn_touch =
-            libevdev_has_event_code(state_touchpad.evdev, EV_KEY, BTN_TOUCH);
-    state_touchpad.has_touch_major =
-            libevdev_has_event_code(state_touchpad.evdev, EV_ABS, ABS_MT_TOUCH_MAJOR);
-    state_touchpad.has_width_major =
-            libevdev_has_event_code(state_touchpad.evdev, EV_ABS, ABS_MT_WIDTH_MAJOR);
-
-    state_touchpad.has_pressure =
-            libevdev_has_event_code(state_touchpad.evdev, EV_ABS, ABS_MT_PRESSURE);
-    state_touchpad.min_pressure = state_touchpad.has_pressure ?
-                                  libevdev_get_abs_minimum(state_touchpad.evdev, ABS_MT_PRESSURE)
-                                                              : 0;
-    state_touchpad.max_pressure = state_touchpad.has_pressure ?
-                                  libevdev_get_abs_maximum(state_touchpad.evdev, ABS_MT_PRESSURE)
-                                                              : 0;
+    return 0;
+}
 
-    state_touchpad.max_x = libevdev_get_abs_maximum(state_touchpad.evdev, ABS_MT_POSITION_X);
-    state_touchpad.max_y = libevdev_get_abs_maximum(state_touchpad.evdev, ABS_MT_POSITION_Y);
+/**
+ * 为客户端的逻辑触控点分配一个空闲的槽位
+ * @param client
+ * @param state
+ * @param contact
+ * @return 槽位下标，没有空闲槽位时返回 -1
+ */
+static int claim_slot(client_t *client, internal_state_touchpad_t *state, int contact) {
+    int slot;
 
-    state_touchpad.max_tracking_id = state_touchpad.has_tracking_id
-                                     ? libevdev_get_abs_maximum(state_touchpad.evdev,
-                                                                ABS_MT_TRACKING_ID)
-                                     : INT_MAX;
+    if (contact < 0 || contact >= state->max_contacts) {
+        return -1;
+    }
 
-    if (!state_touchpad.has_mtslot && state_touchpad.max_tracking_id == 0) {
-        // The touch device reports incorrect values. There would be no point
-        // in supporting ABS_MT_TRACKING_ID at all if the maximum value was 0
-        // (i.e. one contact). This happens on Lenovo Yoga Tablet B6000-F,
-        // which actually seems to support ~10 contacts. So, we'll just go with
-        // as many as we can and hope that the system will ignore extra contacts.
-        state_touchpad.max_tracking_id = MAX_SUPPORTED_CONTACTS - 1;
-        fprintf(stderr,
-                "Note: type A device reports a max value of 0 for ABS_MT_TRACKING_ID. "
-                "This means that the device is most likely reporting incorrect "
-                "information. Guessing %d.\n",
-                state_touchpad.max_tracking_id
-        );
+    if (client->contacts[state->index][contact] >= 0) {
+        return client->contacts[state->index][contact];
     }
 
-    state_touchpad.max_contacts = state_touchpad.has_mtslot
-                                  ? libevdev_get_abs_maximum(state_touchpad.evdev, ABS_MT_SLOT) + 1
-                                  : (state_touchpad.has_tracking_id ?
-                                     state_touchpad.max_tracking_id + 1 : 2);
+    // Prefer the slot matching the logical contact so that a lone client
+    // sees exactly the same slots (and type A tracking IDs) as before.
+    for (slot = contact; slot < contact + state->max_contacts; ++slot) {
+        int candidate = slot % state->max_contacts;
 
-    state_touchpad.tracking_id = 0;
+        if (!state->contacts[candidate].enabled && !is_slot_claimed(state->index, candidate)) {
+            client->contacts[state->index][contact] = candidate;
+            return candidate;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * 提交客户端在触控设备上的改动，其他客户端还没有提交的改动不受影响
+ * @param client
+ * @param state
+ */
+static void client_mark_committed(const client_t *client, internal_state_touchpad_t *state) {
+    int slot;
+
+    for (slot = 0; slot < state->max_contacts; ++slot) {
+        if (state->contacts[slot].owner == client) {
+            state->contacts[slot].owner = NULL;
+        }
+    }
+}
+
+/**
+ * 抬起客户端在所有触控设备上持有的全部触控点并提交，不影响其他客户端
+ * @param client
+ * @param state 主触控设备
+ */
+static void client_release_contacts(client_t *client, internal_state_touchpad_t *state) {
+    internal_state_touchpad_t *target;
+    int device;
+    int contact;
+    int found_any;
+
+    for (device = 0; device < g_touch_device_count; ++device) {
+        target = touch_device(state, device);
+        found_any = 0;
+
+        for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+            if (client->contacts[device][contact] >= 0) {
+                touch_up(target, client->contacts[device][contact]);
+                client->contacts[device][contact] = -1;
+                found_any = 1;
+            }
+        }
+
+        client_mark_committed(client, target);
+
+        if (found_any && target->pace_period != 0) {
+            target->frame_held = 1;
+        } else if (found_any) {
+            commit(target);
+        }
+    }
+}
+
+/**
+ * 获取相对等待的起始时间
+ * @param client
+ * @param now
+ * @return
+ */
+static uint64_t client_schedule_base(client_t *client, uint64_t now) {
+    // Waits are chained off the previous deadline rather than the current
+    // time, so that a long script doesn't accumulate drift. That only holds
+    // for commands that were already read when the deadline fired; anything
+    // sent later waits from now, or a live client's wait would be cut short.
+    // After falling far behind there's nothing sensible to chain off either.
+    if (client->received > client->deadline || client->deadline + MAX_SCHEDULE_LAG_US < now) {
+        return now;
+    }
+
+    return client->deadline;
+}
+
+/**
+ * 设置客户端下一条指令的执行时间
+ * @param client
+ * @param command 'w' 't' 为相对时间，'T' 为相对于连接建立时间的绝对时间
+ */
+static void client_schedule(client_t *client, const command_t *command) {
+    uint64_t now = now_us();
+
+    if (command->op == 'T') {
+        client->deadline = client->origin + command->wait;
+    } else {
+        client->deadline = client_schedule_base(client, now) +
+                           (command->wait > 0 ? command->wait : 0);
+    }
+
+    if (g_verbose)
+        fprintf(stderr, "Waiting until +%lld us\n",
+                (long long) (client->deadline - client->origin));
+
+    client->waiting = client->deadline > now;
+}
+
+/**
+ * 关闭客户端传来但没有用到的 fd
+ * @param client
+ */
+static void client_close_passed_fds(client_t *client) {
+    while (client->passed_count > 0) {
+        close(client->passed_fds[--client->passed_count]);
+    }
+}
+
+/**
+ * 映射客户端随 'M' 传来的 memfd（共享内存队列）和 eventfd，之后从队列中读取二进制记录
+ * @param client
+ * @return 0 成功，-1 失败
+ */
+static int client_attach_ring(client_t *client) {
+    ring_t *ring = &client->ring;
+    ring_header_t *header;
+    struct stat info;
+    int memfd = client->passed_fds[0];
+    int seals;
+
+    if (client->passed_count != 2 || ring->header != NULL) {
+        fprintf(stderr, "'M' needs a memfd and an eventfd, and only works once\n");
+        goto failed;
+    }
+
+    // Without the seal the client could truncate the file under the
+    // mapping, and the next read of the ring would kill us with SIGBUS.
+    seals = fcntl(memfd, F_GET_SEALS);
+
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        fprintf(stderr, "Shared ring must be a memfd sealed with F_SEAL_SHRINK\n");
+        goto failed;
+    }
+
+    if (fstat(memfd, &info) < 0 || (size_t) info.st_size < sizeof(ring_header_t)) {
+        fprintf(stderr, "Shared ring is too small\n");
+        goto failed;
+    }
+
+    header = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        goto failed;
+    }
+
+    if (header->magic != RING_MAGIC || header->size == 0 ||
+        (header->size & (header->size - 1)) != 0 ||
+        (info.st_size - sizeof(ring_header_t)) / BINARY_RECORD_SIZE < header->size) {
+        fprintf(stderr, "Shared ring has a bad header\n");
+        munmap(header, info.st_size);
+        goto failed;
+    }
+
+    ring->header = header;
+    ring->records = (const unsigned char *) header + sizeof(ring_header_t);
+    ring->length = info.st_size;
+    ring->mask = header->size - 1;
+    ring->tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+    ring->event_fd = client->passed_fds[1];
+    ring->watched = 0;
+
+    fcntl(ring->event_fd, F_SETFL, fcntl(ring->event_fd, F_GETFL) | O_NONBLOCK);
+
+    // The mapping keeps the memory alive, only the eventfd is still needed.
+    close(memfd);
+    client->passed_count = 0;
+
+    if (g_verbose)
+        fprintf(stderr, "Attached shared ring with %u records\n", header->size);
+
+    return 0;
+
+    failed:
+    client_close_passed_fds(client);
+    return -1;
+}
+
+/**
+ * 从共享内存队列取出一条记录
+ * @param client
+ * @param command
+ * @return 1 取到，0 队列为空或没有队列
+ */
+static int client_ring_pop(client_t *client, command_t *command) {
+    ring_t *ring = &client->ring;
+    uint64_t head;
+
+    if (ring->header == NULL) {
+        return 0;
+    }
+
+    head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+
+    // A head that ran past the end can only come from a broken client,
+    // which must not make us read records that are being overwritten.
+    if (head == ring->tail || head - ring->tail > ring->mask + 1) {
+        return 0;
+    }
+
+    parse_binary_input(&ring->records[(ring->tail & ring->mask) * BINARY_RECORD_SIZE], command);
+    ring->tail += 1;
+    __atomic_store_n(&ring->header->tail, ring->tail, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * 取消映射客户端的共享内存队列
+ * @param epoll_fd
+ * @param client
+ */
+static void client_detach_ring(int epoll_fd, client_t *client) {
+    ring_t *ring = &client->ring;
+
+    if (ring->header == NULL) {
+        return;
+    }
+
+    // The client still holds the eventfd, closing ours alone would leave it
+    // registered with epoll.
+    if (ring->watched) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ring->event_fd, NULL);
+    }
+
+    close(ring->event_fd);
+    munmap(ring->header, ring->length);
+    ring->header = NULL;
+}
+
+/**
+ * 回复客户端一次提交的序号和帧的写入时间
+ * @param client
+ * @param time 写入时间（微秒）
+ */
+static void client_acknowledge(client_t *client, uint64_t time) {
+    char buffer[64];
+
+    client->commits += 1;
+    client_send(client, buffer,
+                snprintf(buffer, sizeof(buffer), "a %u %llu\n",
+                         client->commits, (unsigned long long) time));
+}
+
+/**
+ * 写出被 -P 推迟的帧，并回复等待这一帧的提交
+ * @param state
+ */
+static void write_held_frame(internal_state_touchpad_t *state) {
+    uint64_t now;
+    int i;
+
+    if (!state->frame_held) {
+        return;
+    }
+
+    state->frame_held = 0;
+    commit(state);
+    now = now_ns();
+
+    // Keep to the cadence rather than to when we got around to it.
+    state->pace_next += state->pace_period;
+
+    if (state->pace_next < now) {
+        state->pace_next = now + state->pace_period;
+    }
+
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        while (g_clients[i].fd >= 0 && g_clients[i].acks_held[state->index] > 0) {
+            g_clients[i].acks_held[state->index] -= 1;
+            client_acknowledge(&g_clients[i], now / 1000);
+        }
+    }
+}
+
+/**
+ * 将客户端的逻辑触控点转换为实际槽位后执行指令
+ * @param client
+ * @param command
+ * @param state
+ */
+static void client_apply(client_t *client, command_t *command, internal_state_touchpad_t *state) {
+    int valid = command->contact >= 0 && command->contact < MAX_SUPPORTED_CONTACTS;
+    internal_state_touchpad_t *target = touch_device(state, client->device);
+    int slot = valid ? client->contacts[client->device][command->contact] : -1;
+    char buffer[1536];
+
+    command->received = client->received;
+
+    switch (command->op) {
+        case 'D': // SELECT TOUCH DEVICE
+            if (command->contact < 0 || command->contact >= g_touch_device_count) {
+                goto rejected;
+            }
+
+            client->device = (int) command->contact;
+            return;
+        case 's': // STATS
+            client_send(client, buffer, format_stats(buffer, sizeof(buffer)));
+            return;
+        case 'a': // ACKNOWLEDGE COMMITS
+            client->ack = 1;
+            return;
+        case 'M': // MAP SHARED RING
+            client_send(client, buffer,
+                        snprintf(buffer, sizeof(buffer), "M %u\n",
+                                 client_attach_ring(client) == 0 ? client->ring.header->size : 0));
+            return;
+        case 'w': // WAIT
+        case 't':
+        case 'T':
+            client_schedule(client, command);
+            return;
+        case 'r': // RESET
+            // Only the client's own contacts are reset, others keep going.
+            client_release_contacts(client, state);
+            return;
+        case 'd': // TOUCH DOWN
+            if (slot >= 0) {
+                // Two downs for the same contact; same panic as the driver-level reset.
+                client_release_contacts(client, state);
+            }
+
+            slot = claim_slot(client, target, command->contact);
+
+            if (slot < 0) {
+                if (g_verbose)
+                    fprintf(stderr, "No free slot for contact %ld\n", command->contact);
+                goto rejected;
+            }
+
+            if (target->frame_held && target->contacts[slot].enabled) {
+                // The slot has to reach the device before it can go down
+                // again, wait for the held frame like a 'u' does below.
+                if (client->gesture.kind == GESTURE_NONE) {
+                    client->held = *command;
+                    client->stalled = 1;
+                    return;
+                }
+
+                write_held_frame(target);
+            }
+            break;
+        case 'm': // TOUCH MOVE
+            if (slot < 0) {
+                goto rejected;
+            }
+            break;
+        case 'u': // TOUCH UP
+            if (slot < 0) {
+                goto rejected;
+            }
+
+            if (target->frame_held && target->contacts[slot].enabled == 1) {
+                // The down is still held back, lifting now would cancel it.
+                if (client->gesture.kind == GESTURE_NONE) {
+                    client->held = *command;
+                    client->stalled = 1;
+                    return;
+                }
+
+                // A gesture step can't be split, so the frame goes out early.
+                write_held_frame(target);
+            }
+
+            client->contacts[client->device][command->contact] = -1;
+            break;
+    }
+
+    if (command->op == 'c') {
+        client_mark_committed(client, target);
+    }
+
+    command->contact = slot;
+    apply_command(command, target);
+
+    // Until its 'c', the change is left out of frames other clients commit.
+    if ((command->op == 'd' || command->op == 'm' || command->op == 'u') &&
+        target->contacts[slot].enabled) {
+        target->contacts[slot].owner = client;
+    }
+
+    // Commits made by a gesture are the gesture's own business.
+    if (command->op == 'c' && client->ack && client->gesture.kind == GESTURE_NONE) {
+        if (target->frame_held) {
+            client->acks_held[client->device] += 1;
+        } else {
+            client_acknowledge(client, now_us());
+        }
+    }
+    return;
+
+    rejected:
+    g_stats.commands += 1;
+    g_stats.rejected += 1;
+}
+
+/**
+ * 切换到设备表中分值最高的触控设备，目标没有变化时什么都不做。
+ * 在注入线程中执行，写入中途不会换掉设备
+ * @param state
+ */
+static void switch_touch_device(internal_state_touchpad_t *state) {
+    device_entry_t entry;
+    device_probe_t probe;
+    struct libevdev *evdev = NULL;
+    char header[64];
+    int old_limits[4] = {state->max_contacts, state->max_x, state->max_y, state->max_pressure};
+    int type;
+    int fd;
+    int i;
+    int contact;
+
+    if (!best_touch_device(&entry)) {
+        fprintf(stderr, "Note: no touch device left, keeping %s\n", state->path);
+        return;
+    }
+
+    if (entry.serial == state->serial) {
+        return;
+    }
+
+    if ((fd = open_and_probe_device(entry.path, &probe, &type)) < 0) {
+        return;
+    }
+
+    if (libevdev_new_from_fd(fd, &evdev) < 0) {
+        fprintf(stderr, "Note: device %s is not supported by libevdev\n", entry.path);
+        close(fd);
+        return;
+    }
+
+    // Lift everything on the old device while it may still be there. The
+    // contacts of every client are gone as well, none of them exist on the
+    // new device.
+    write_held_frame(state);
+    touch_panic_reset_all(state);
+
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+            g_clients[i].contacts[0][contact] = -1;
+        }
+    }
+
+    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+        g_input_client.contacts[0][contact] = -1;
+    }
+
+    fprintf(stderr, "Switching touch device from %s to %s\n", state->path, entry.path);
+
+    libevdev_free(state->evdev);
+    close(state->fd);
+
+    state->fd = fd;
+    state->evdev = evdev;
+    state->score = entry.score;
+    state->serial = entry.serial;
+    state->id = probe.id;
+    memset(state->path, 0, sizeof(state->path));
+    memset(state->name, 0, sizeof(state->name));
+    strncpy(state->path, entry.path, sizeof(state->path) - 1);
+    strncpy(state->name, probe.name, sizeof(state->name) - 1);
+    state->active_contacts = 0;
+    memset(state->contacts, 0, sizeof(state->contacts));
+    setup_touch_device(state);
+
+    // Clients scale to the limits from the header, tell them if they changed.
+    if (old_limits[0] != state->max_contacts || old_limits[1] != state->max_x ||
+        old_limits[2] != state->max_y || old_limits[3] != state->max_pressure) {
+        int length = snprintf(header, sizeof(header), "^ %d %d %d %d\n", state->max_contacts,
+                              state->max_x, state->max_y, state->max_pressure);
+
+        for (i = 0; i < MAX_CLIENTS; ++i) {
+            if (g_clients[i].fd >= 0) {
+                client_send(&g_clients[i], header, length);
+            }
+        }
+    }
+}
+
+/**
+ * 按分值从高到低打开主触控设备以外的触控设备，供 'D' 指令选择
+ * @param state 主触控设备
+ * @return 打开的触控设备总数，包括主触控设备
+ */
+static int open_extra_touch_devices(internal_state_touchpad_t *state) {
+    device_entry_t entries[MAX_REGISTERED_DEVICES];
+    device_entry_t entry;
+    device_probe_t probe;
+    internal_state_touchpad_t *extra;
+    int best;
+    int type;
+    int fd;
+    int i;
+
+    pthread_mutex_lock(&g_devices_lock);
+    memcpy(entries, g_devices, sizeof(entries));
+    pthread_mutex_unlock(&g_devices_lock);
+
+    while (g_touch_device_count < MAX_TOUCH_DEVICES) {
+        best = -1;
+
+        for (i = 0; i < MAX_REGISTERED_DEVICES; ++i) {
+            if (entries[i].path[0] != 0 && entries[i].score > 0 &&
+                strcmp(entries[i].path, state->path) != 0 &&
+                (best < 0 || entries[i].score > entries[best].score)) {
+                best = i;
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        entry = entries[best];
+        entries[best].path[0] = 0;
+
+        if ((fd = open_and_probe_device(entry.path, &probe, &type)) < 0) {
+            continue;
+        }
+
+        extra = &g_extra_touch_devices[g_touch_device_count - 1];
+        memset(extra, 0, sizeof(*extra));
+        extra->fd = fd;
+        extra->score = entry.score;
+        extra->serial = entry.serial;
+        extra->id = probe.id;
+        strncpy(extra->path, entry.path, sizeof(extra->path) - 1);
+        strncpy(extra->name, probe.name, sizeof(extra->name) - 1);
+
+        if (libevdev_new_from_fd(fd, &extra->evdev) < 0) {
+            fprintf(stderr, "Note: device %s is not supported by libevdev\n", entry.path);
+            close(fd);
+            continue;
+        }
+
+        setup_touch_device(extra);
+        extra->index = g_touch_device_count;
+        extra->pace_period = state->pace_period;
+        g_touch_device_count += 1;
+
+        fprintf(stderr, "Also injecting into %s (%s) as device %d\n",
+                extra->path, extra->name, extra->index);
+    }
+
+    return g_touch_device_count;
+}
+
+/**
+ * 执行其他线程放入指令队列的全部指令
+ * @param state
+ */
+static void run_queued_commands(internal_state_touchpad_t *state) {
+    command_t command;
+    uint64_t count;
+
+    read(g_commands.event_fd, &count, sizeof(count));
+
+    // A stalled input client picks up where it left off after the next frame.
+    while (!g_input_client.stalled && command_queue_pop(&g_commands, &command)) {
+        if (command.op == 'H') { // TOUCH DEVICE CHANGED
+            switch_touch_device(state);
+            continue;
+        }
+
+        // Waits make no sense for live input and there's nowhere to write
+        // stats to, only the touch commands themselves are taken.
+        if (command.op == 'c' || command.op == 'r' || command.op == 'd' ||
+            command.op == 'm' || command.op == 'u') {
+            client_apply(&g_input_client, &command, state);
+        }
+    }
+}
+
+static double ease(int easing, double t) {
+    switch (easing) {
+        case EASE_IN:
+            return t * t;
+        case EASE_OUT:
+            return t * (2 - t);
+        case EASE_IN_OUT:
+            return t < 0.5 ? 2 * t * t : -1 + (4 - 2 * t) * t;
+        default:
+            return t;
+    }
+}
+
+static long clamp(long value, long max) {
+    return value < 0 ? 0 : (value > max ? max : value);
+}
+
+/**
+ * 计算手势中第 index 个触控点在进度 t（0~1）时的位置
+ * @param gesture
+ * @param index
+ * @param t
+ * @param command 输出坐标
+ * @param state
+ */
+static void gesture_position(const gesture_t *gesture, int index, double t,
+                             command_t *command, internal_state_touchpad_t *state) {
+    double x;
+    double y;
+    double e = ease(gesture->easing, t);
+
+    if (gesture->kind == GESTURE_LINEAR) {
+        x = gesture->x0 + (gesture->x1 - gesture->x0) * e;
+        y = gesture->y0 + (gesture->y1 - gesture->y0) * e;
+    } else {
+        // The second contact mirrors the first one through the center.
+        double r = gesture->r0 + (gesture->r1 - gesture->r0) * e;
+        double a = gesture->a0 + (gesture->a1 - gesture->a0) * e + index * M_PI;
+        x = gesture->cx + r * cos(a);
+        y = gesture->cy + r * sin(a);
+    }
+
+    command->contact = gesture->contacts[index];
+    command->x = clamp(lround(x), state->max_x);
+    command->y = clamp(lround(y), state->max_y);
+    command->pressure = gesture->pressure;
+}
+
+static void gesture_emit(client_t *client, char op, double t, internal_state_touchpad_t *state) {
+    command_t command = {0};
+    int i;
+
+    for (i = 0; i < client->gesture.count; ++i) {
+        gesture_position(&client->gesture, i, t, &command, touch_device(state, client->device));
+        command.op = op;
+        client_apply(client, &command, state);
+    }
+
+    command.op = 'c';
+    client_apply(client, &command, state);
+}
+
+/**
+ * 执行手势的下一步，并把客户端的等待时间设置为再下一步的时间
+ * @param client
+ * @param state
+ */
+static void gesture_step(client_t *client, internal_state_touchpad_t *state) {
+    gesture_t *gesture = &client->gesture;
+    uint64_t next;
+
+    gesture->step += 1;
+    gesture_emit(client, 'm', (double) gesture->step / gesture->steps, state);
+
+    if (gesture->step == gesture->steps) {
+        gesture_emit(client, 'u', 1, state);
+        gesture->kind = GESTURE_NONE;
+        return;
+    }
+
+    next = gesture->start + gesture->duration * (gesture->step + 1) / gesture->steps;
+    client->deadline = next;
+    client->waiting = 1;
+}
+
+static int parse_easing(const char *name) {
+    if (strcmp(name, "in") == 0) {
+        return EASE_IN;
+    } else if (strcmp(name, "out") == 0) {
+        return EASE_OUT;
+    } else if (strcmp(name, "inout") == 0) {
+        return EASE_IN_OUT;
+    }
+
+    return EASE_LINEAR;
+}
+
+/**
+ * 从 cursor 解析 count 个整数
+ * @return 成功解析的个数
+ */
+static int parse_numbers(char **cursor, long *values, int count) {
+    int i;
+    char *end;
+
+    for (i = 0; i < count; ++i) {
+        values[i] = strtol(*cursor, &end, 10);
+
+        if (end == *cursor) {
+            break;
+        }
+
+        *cursor = end;
+    }
+
+    return i;
+}
+
+/**
+ * 解析并开始一个手势
+ *
+ *   g swipe <contact> <x0> <y0> <x1> <y1> <ms> [easing]
+ *   g fling <contact> <x0> <y0> <x1> <y1> <ms>
+ *   g pinch <contact0> <contact1> <cx> <cy> <r0> <r1> <ms> [easing]
+ *   g rotate <contact0> <contact1> <cx> <cy> <r> <deg0> <deg1> <ms> [easing]
+ *
+ * @param client
+ * @param buffer
+ * @param state
+ */
+static void client_start_gesture(client_t *client, char *buffer, internal_state_touchpad_t *state) {
+    gesture_t *gesture = &client->gesture;
+    char name[16];
+    char easing[16] = "";
+    long values[8];
+    long duration;
+    int offset = 0;
+    char *cursor;
+
+    if (sscanf(buffer, "g %15s %n", name, &offset) < 1 || offset == 0) {
+        return;
+    }
+
+    cursor = buffer + offset;
+    memset(gesture, 0, sizeof(*gesture));
+
+    if (strcmp(name, "swipe") == 0 || strcmp(name, "fling") == 0) {
+        if (parse_numbers(&cursor, values, 6) < 6) {
+            goto invalid;
+        }
+
+        gesture->kind = GESTURE_LINEAR;
+        gesture->count = 1;
+        gesture->contacts[0] = values[0];
+        gesture->x0 = clamp(values[1], state->max_x);
+        gesture->y0 = clamp(values[2], state->max_y);
+        gesture->x1 = clamp(values[3], state->max_x);
+        gesture->y1 = clamp(values[4], state->max_y);
+        duration = values[5];
+
+        // A fling lifts off at full speed, so it accelerates towards the end.
+        gesture->easing = name[0] == 'f' ? EASE_IN : EASE_LINEAR;
+    } else if (strcmp(name, "pinch") == 0) {
+        if (parse_numbers(&cursor, values, 7) < 7) {
+            goto invalid;
+        }
+
+        gesture->kind = GESTURE_POLAR;
+        gesture->count = 2;
+        gesture->contacts[0] = values[0];
+        gesture->contacts[1] = values[1];
+        gesture->cx = values[2];
+        gesture->cy = values[3];
+        gesture->r0 = values[4];
+        gesture->r1 = values[5];
+        duration = values[6];
+    } else if (strcmp(name, "rotate") == 0) {
+        if (parse_numbers(&cursor, values, 8) < 8) {
+            goto invalid;
+        }
+
+        gesture->kind = GESTURE_POLAR;
+        gesture->count = 2;
+        gesture->contacts[0] = values[0];
+        gesture->contacts[1] = values[1];
+        gesture->cx = values[2];
+        gesture->cy = values[3];
+        gesture->r0 = gesture->r1 = values[4];
+        gesture->a0 = values[5] * M_PI / 180;
+        gesture->a1 = values[6] * M_PI / 180;
+        duration = values[7];
+    } else {
+        goto invalid;
+    }
+
+    if (gesture->count == 2 && gesture->contacts[0] == gesture->contacts[1]) {
+        goto invalid;
+    }
+
+    if (sscanf(cursor, "%15s", easing) == 1) {
+        gesture->easing = parse_easing(easing);
+    }
+
+    gesture->pressure = state->has_pressure ? (state->min_pressure + state->max_pressure) / 2 : 0;
+    gesture->start = client_schedule_base(client, now_us());
+    gesture->duration = duration > 0 ? (uint64_t) duration * 1000 : 0;
+    gesture->steps = (int) ((gesture->duration * g_frame_rate + 999999) / 1000000);
+    gesture->step = 0;
+
+    if (gesture->steps < 1) {
+        gesture->steps = 1;
+    }
+
+    if (g_verbose)
+        fprintf(stderr, "Starting %s gesture with %d steps\n", name, gesture->steps);
+
+    client->deadline = gesture->start;
+    gesture_emit(client, 'd', 0, state);
+
+    client->deadline = gesture->start + gesture->duration / gesture->steps;
+    client->waiting = 1;
+    return;
+
+    invalid:
+    gesture->kind = GESTURE_NONE;
+    g_stats.commands += 1;
+    g_stats.rejected += 1;
+    fprintf(stderr, "Invalid gesture '%s'\n", buffer);
+}
+
+static void client_parse_line(client_t *client, char *line, internal_state_touchpad_t *state) {
+    command_t command;
+
+    line[strcspn(line, "\r")] = 0; //按行读取缓冲数据
+
+    if (line[0] == 0) {
+        return;
+    }
+
+    if (line[0] == 'b') {
+        // Switch to the binary protocol for the rest of the session.
+        if (g_verbose)
+            fprintf(stderr, "Switching to binary protocol\n");
+        client->binary = 1;
+        return;
+    }
+
+    if (line[0] == 'g') {
+        client_start_gesture(client, line, state);
+        return;
+    }
+
+    parse_input(line, &command); //解析缓冲数据
+    client_apply(client, &command, state);
+}
+
+/**
+ * 解析客户端缓冲区中所有完整的行（或二进制记录），遇到尚未到期的等待时停止
+ * @param client
+ * @param state
+ * @return 客户端是否正在等待
+ */
+static int client_process(client_t *client, internal_state_touchpad_t *state) {
+    command_t command;
+
+    while (1) {
+        // A client not reading its replies is slowed down to its own pace
+        // rather than having them dropped.
+        if (client->stalled || client_backlogged(client)) {
+            break;
+        }
+
+        if (client->waiting) {
+            if (now_us() < client->deadline) {
+                break;
+            }
+
+            client->waiting = 0;
+            client->received = client->deadline;
+        }
+
+        if (client->gesture.kind != GESTURE_NONE) {
+            gesture_step(client, state);
+            continue;
+        }
+
+        if (client->start >= client->end) {
+            // The shared ring is drained once the socket has nothing left.
+            if (client_ring_pop(client, &command)) {
+                client_apply(client, &command, state);
+                continue;
+            }
+            break;
+        }
+
+        if (client->binary) {
+            if (client->end - client->start < BINARY_RECORD_SIZE) {
+                break;
+            }
+
+            parse_binary_input((unsigned char *) &client->buffer[client->start], &command);
+            client->start += BINARY_RECORD_SIZE;
+            client_apply(client, &command, state);
+            continue;
+        }
+
+        char *line = &client->buffer[client->start];
+        char *newline = memchr(line, '\n', client->end - client->start);
+
+        if (newline == NULL) {
+            break;
+        }
+
+        *newline = 0;
+        client->start = newline - client->buffer + 1;
+        client_parse_line(client, line, state);
+    }
+
+    // Keep the unconsumed tail (a partial line or record) at the front.
+    memmove(client->buffer, &client->buffer[client->start], client->end - client->start);
+    client->end -= client->start;
+    client->start = 0;
+
+    if (client->end == sizeof(client->buffer) - 1 && !client->waiting && !client_backlogged(client)) {
+        fprintf(stderr, "Discarding overlong line\n");
+        client->end = 0;
+    }
+
+    return client->waiting;
+}
+
+/**
+ * 从 socket 读取数据，同时收下随数据通过 SCM_RIGHTS 传来的 fd
+ * @param client
+ * @param space
+ * @return 同 read
+ */
+static ssize_t client_receive(client_t *client, size_t space) {
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int) * 2)];
+    } control;
+    struct iovec iov;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    ssize_t result;
+
+    iov.iov_base = &client->buffer[client->end];
+    iov.iov_len = space;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    result = recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC);
+
+    if (result < 0) {
+        return result;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int *fds = (int *) CMSG_DATA(cmsg);
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int i;
+
+            for (i = 0; i < count; ++i) {
+                if (client->passed_count < 2) {
+                    client->passed_fds[client->passed_count++] = fds[i];
+                } else {
+                    close(fds[i]);
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * 从客户端读取一次数据并解析。等待期间也会继续读取，直到缓冲区写满
+ * @param client
+ * @param state
+ * @return 读到的字节数，0 表示连接已关闭，-1 表示出错（缓冲区已满时 errno 为 EAGAIN）
+ */
+static ssize_t client_read(client_t *client, internal_state_touchpad_t *state) {
+    size_t space = sizeof(client->buffer) - client->end - 1;
+
+    if (space == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Input is read in bulk straight off the descriptor rather than through
+    // stdio, as the client may switch to the binary protocol at any point and
+    // we must not lose whatever stdio would have buffered past that line.
+    ssize_t result = client->socket ? client_receive(client, space)
+                                    : read(client->fd, &client->buffer[client->end], space);
+
+    if (result > 0) {
+        client->end += result;
+        client->received = now_us();
+        client_process(client, state);
+    }
+
+    return result;
+}
+
+static client_t *client_open(int fd, int output_fd, internal_state_touchpad_t *state) {
+    int i;
+    char header[128];
+    client_t *client = NULL;
+
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        if (g_clients[i].fd < 0) {
+            client = &g_clients[i];
+            break;
+        }
+    }
+
+    if (client == NULL) {
+        return NULL;
+    }
+
+    client->fd = fd;
+    client->output_fd = output_fd;
+    client->binary = 0;
+    client->closing = 0;
+    client->paused = 0;
+    client->writing = 0;
+    client->output_len = 0;
+    client->socket = 0;
+    client->ack = 0;
+    client->commits = 0;
+    client->device = 0;
+    memset(client->acks_held, 0, sizeof(client->acks_held));
+    client->stalled = 0;
+    client->passed_count = 0;
+    client->ring.header = NULL;
+    client->start = 0;
+    client->end = 0;
+    client->origin = now_us();
+    client->deadline = client->origin;
+    client->waiting = 0;
+    client->received = client->origin;
+    client->gesture.kind = GESTURE_NONE;
+
+    // All bits set is -1, nothing is mapped on any device yet.
+    memset(client->contacts, 0xff, sizeof(client->contacts));
+
+    // Tell version, limits and pid
+    int length = snprintf(header, sizeof(header), "v %d\n^ %d %d %d %d\n$ %d\n",
+                          VERSION, state->max_contacts, state->max_x, state->max_y,
+                          state->max_pressure, getpid());
+
+    client_send(client, header, length);
+
+    // With -A each device announces its own limits, selected with 'D'.
+    for (i = 0; g_touch_device_count > 1 && i < g_touch_device_count; ++i) {
+        internal_state_touchpad_t *device = touch_device(state, i);
+        char line[384];
+
+        length = snprintf(line, sizeof(line), "D %d %d %d %d %d %s\n",
+                          i, device->max_contacts, device->max_x, device->max_y,
+                          device->max_pressure, device->name);
+        client_send(client, line, length);
+    }
+
+    return client;
+}
+
+static void client_close(client_t *client, internal_state_touchpad_t *state) {
+    // A last line without a trailing newline still counts.
+    if (!client->binary && client->end > 0) {
+        client->buffer[client->end] = 0;
+        client_parse_line(client, client->buffer, state);
+    }
+
+    // Never leave contacts hanging after the client that owns them is gone.
+    client_release_contacts(client, state);
+    client->fd = -1;
+}
+
+/**
+ * 等待输入可读，最多等到 deadline 前最后忙等的一段
+ * @param fd
+ * @param deadline CLOCK_MONOTONIC 微秒
+ * @return 输入是否可读
+ */
+static int wait_readable(int fd, uint64_t deadline) {
+    struct pollfd pfd;
+    uint64_t now = now_us();
+
+    // poll only counts whole milliseconds, sleep_until does the rest.
+    if (deadline < now + SPIN_WAIT_US + 1000) {
+        return 0;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    return poll(&pfd, 1, (int) ((deadline - now - SPIN_WAIT_US) / 1000)) > 0;
+}
+
+/**
+ * 以阻塞方式处理单个输入（STDIN 或文件）
+ * @param input_fd
+ * @param output_fd
+ * @param state
+ */
+static void io_handler(int input_fd, int output_fd, internal_state_touchpad_t *state) {
+    client_t *client = client_open(input_fd, output_fd, state);
+    ssize_t result;
+    int ended = 0;
+
+    while (1) {
+        dump_stats_if_requested();
+
+        if (client_process(client, state)) {
+            // Like a socket client, input keeps being read ahead during a
+            // wait, so the commands after it are ready when it is over.
+            if (!ended && client->end < sizeof(client->buffer) - 1 &&
+                wait_readable(client->fd, client->deadline)) {
+                result = client_read(client, state);
+                ended = result == 0 || (result < 0 && errno != EINTR);
+                continue;
+            }
+
+            sleep_until(client->deadline);
+            continue;
+        }
+
+        if (ended) {
+            break;
+        }
+
+        result = client_read(client, state);
+
+        if (result == 0 || (result < 0 && errno != EINTR)) {
+            break;
+        }
+    }
+
+    client_close(client, state);
+}
+
+typedef struct {
+    uint64_t time; // 相对于脚本开始的时间（微秒）
+    size_t end; // 该帧最后一个事件之后的下标
+} script_frame_t;
+
+typedef struct {
+    script_frame_t *frames; // 事件本身在 state->capture 中
+    size_t frame_count;
+    size_t frame_size;
+    int sealed; // 最后一帧已经开始回放，同一时间的提交不能再合并进去
+    const char *data; // 映射到内存的脚本
+    size_t size;
+    size_t position; // 下一条未编译的指令
+    uint64_t clock; // 编译到的虚拟时间，编译时放到 g_script_clock
+    int compiled; // 整个脚本都已编译
+} script_t; // 由 -f 脚本编译成的定时事件帧，编译和回放交替进行
+
+/**
+ * 把自上一帧以来新产生的事件记为 time 时写出的一帧，同一时间的提交合并成一帧
+ * @param script
+ * @param time
+ * @param end
+ * @return 0 成功，-1 内存不足
+ */
+static int script_add_frame(script_t *script, uint64_t time, size_t end) {
+    script_frame_t *last = script->frame_count ? &script->frames[script->frame_count - 1] : NULL;
+    script_frame_t *frames;
+
+    if (end == (last ? last->end : 0)) {
+        return 0;
+    }
+
+    if (last && last->time == time && !script->sealed) {
+        last->end = end;
+        return 0;
+    }
+
+    if (script->frame_count == script->frame_size) {
+        size_t size = script->frame_size ? script->frame_size * 2 : 1024;
+
+        frames = realloc(script->frames, size * sizeof(*frames));
+
+        if (frames == NULL) {
+            return -1;
+        }
+
+        script->frames = frames;
+        script->frame_size = size;
+    }
+
+    script->frames[script->frame_count].time = time;
+    script->frames[script->frame_count].end = end;
+    script->frame_count += 1;
+    script->sealed = 0;
+
+    return 0;
+}
+
+/**
+ * 按与 client_process 相同的规则编译脚本中的下一条指令，等待只推进虚拟时钟，
+ * 产生的事件记录到 state->capture，每次提交的时间记录到 script
+ * @param script
+ * @param client
+ * @param state capture 模式
+ * @return 0 成功，-1 内存不足
+ */
+static int compile_script_step(script_t *script, client_t *client, internal_state_touchpad_t *state) {
+    static char line[READ_BUFFER_SIZE];
+    const char *data = script->data;
+    const char *newline;
+    size_t length;
+    command_t command;
+
+    if (script_add_frame(script, g_script_clock - client->origin, state->capture_len) < 0) {
+        return -1;
+    }
+
+    if (client->waiting) {
+        if (client->deadline > g_script_clock) {
+            g_script_clock = client->deadline;
+        }
+
+        client->waiting = 0;
+        client->received = client->deadline;
+    }
+
+    if (client->gesture.kind != GESTURE_NONE) {
+        gesture_step(client, state);
+        return 0;
+    }
+
+    if (script->position >= script->size ||
+        (client->binary && script->size - script->position < BINARY_RECORD_SIZE)) {
+        // Same as closing a connection, nothing is left down at the end.
+        client_release_contacts(client, state);
+        script->compiled = 1;
+
+        return script_add_frame(script, g_script_clock - client->origin, state->capture_len);
+    }
+
+    if (client->binary) {
+        parse_binary_input((const unsigned char *) &data[script->position], &command);
+        script->position += BINARY_RECORD_SIZE;
+        client_apply(client, &command, state);
+        return 0;
+    }
+
+    // Only the current line is copied out to terminate it, writing into
+    // the private mapping instead would copy every page of the file.
+    newline = memchr(&data[script->position], '\n', script->size - script->position);
+    length = newline != NULL ? (size_t) (newline - &data[script->position])
+                             : script->size - script->position;
+
+    if (length < sizeof(line)) {
+        memcpy(line, &data[script->position], length);
+        line[length] = 0;
+        client_parse_line(client, line, state);
+    } else {
+        fprintf(stderr, "Discarding overlong line\n");
+    }
+
+    script->position += length + 1;
+
+    return 0;
+}
+
+/**
+ * 在脚本的虚拟时钟下编译一条指令，回放仍然使用真实时间
+ * @param script
+ * @param client
+ * @param state
+ * @return 0 成功，-1 内存不足
+ */
+static int compile_script(script_t *script, client_t *client, internal_state_touchpad_t *state) {
+    int result;
+
+    g_script_clock = script->clock;
+    result = compile_script_step(script, client, state);
+    script->clock = g_script_clock;
+    g_script_clock = 0;
+
+    return result;
+}
+
+/**
+ * 丢弃已经回放的帧和事件，把剩下的移到缓冲的开头
+ * @param script
+ * @param state
+ * @param played 已回放的帧数
+ * @param first 已回放的事件数
+ */
+static void script_discard(script_t *script, internal_state_touchpad_t *state,
+                           size_t played, size_t first) {
+    size_t i;
+
+    memmove(script->frames, &script->frames[played],
+            (script->frame_count - played) * sizeof(*script->frames));
+    script->frame_count -= played;
+
+    for (i = 0; i < script->frame_count; ++i) {
+        script->frames[i].end -= first;
+    }
+
+    memmove(state->capture, &state->capture[first],
+            (state->capture_len - first) * sizeof(*state->capture));
+    state->capture_len -= first;
+}
+
+/**
+ * 将 -f 脚本映射到内存并编译成定时的事件帧，回放时只按时间写出事件。
+ * 最多预先编译 SCRIPT_WINDOW_EVENTS 个事件，之后在等待下一帧的空闲时间里继续编译，
+ * 解析的开销不会影响回放的时间，内存占用也不随脚本大小增长
+ * @param input_fd
+ * @param output_fd
+ * @param state
+ * @return 1 已回放，0 无法映射（例如管道），需要逐行读取，-1 内存不足
+ */
+static int play_script(int input_fd, int output_fd, internal_state_touchpad_t *state) {
+    script_t script = {0};
+    struct stat info;
+    client_t *client;
+    char *data;
+    uint64_t started;
+    uint64_t due = 0;
+    size_t events = 0;
+    size_t frames = 0;
+    size_t played = 0;
+    size_t first = 0;
+    size_t ready;
+    int result = 0;
+
+    if (state->capturing || fstat(input_fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        return 0;
+    }
+
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+    script.data = data;
+    script.size = info.st_size;
+
+    // The script starts at virtual time 1, 0 would mean the real clock.
+    g_script_clock = 1;
+    script.clock = 1;
+    state->capturing = 1;
+
+    client = client_open(input_fd, output_fd, state);
+    g_script_clock = 0;
+
+    // A head start, so that playback rarely has to wait for the compiler.
+    while (!script.compiled && state->capture_len < SCRIPT_WINDOW_EVENTS) {
+        if ((result = compile_script(&script, client, state)) < 0) {
+            goto done;
+        }
+    }
+
+    started = now_us();
+
+    while (1) {
+        // Played events are dropped once they fill half the window, so the
+        // buffer never grows much beyond one window.
+        if (first >= SCRIPT_WINDOW_EVENTS / 2) {
+            script_discard(&script, state, played, first);
+            played = 0;
+            first = 0;
+        }
+
+        // The last frame may still take commits made at the same time,
+        // unless it is all that's left and the window is full.
+        ready = script.frame_count;
+
+        if (!script.compiled && ready > 0 &&
+            (played + 1 < ready || state->capture_len - first < SCRIPT_WINDOW_EVENTS)) {
+            ready -= 1;
+        } else if (!script.compiled && ready > 0) {
+            script.sealed = 1;
+        }
+
+        if (played < ready) {
+            due = started + script.frames[played].time;
+        }
+
+        // Compile ahead only while there's time left before the next frame.
+        if (!script.compiled && state->capture_len - first < SCRIPT_WINDOW_EVENTS &&
+            (played == ready || now_us() + SPIN_WAIT_US < due)) {
+            if ((result = compile_script(&script, client, state)) < 0) {
+                goto done;
+            }
+            continue;
+        }
+
+        if (played == ready) {
+            break;
+        }
+
+        dump_stats_if_requested();
+        sleep_until(due);
+
+        // A failed write loses this frame only, as with live input.
+        write_events(state, &state->capture[first], script.frames[played].end - first);
+        events += script.frames[played].end - first;
+        frames += 1;
+        first = script.frames[played].end;
+        played += 1;
+    }
+
+    fprintf(stderr, "Played %zu events in %zu frames\n", events, frames);
+    result = 1;
+
+    done:
+    if (result < 0) {
+        fprintf(stderr, "Not enough memory to compile the script\n");
+    }
+
+    client->fd = -1;
+    state->capturing = 0;
+    munmap(data, info.st_size);
+    free(script.frames);
+    free(state->capture);
+    state->capture = NULL;
+    state->capture_len = 0;
+    state->capture_size = 0;
+
+    return result;
+}
+
+/**
+ * 根据各客户端的等待时间设置 timerfd，提前 SPIN_WAIT_US 微秒唤醒
+ * @param timer_fd
+ * @return 最早的等待时间，没有客户端在等待时返回 0
+ */
+static uint64_t arm_timer(int timer_fd) {
+    struct itimerspec spec;
+    uint64_t earliest = 0;
+    uint64_t wakeup;
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        if (g_clients[i].fd >= 0 && g_clients[i].waiting &&
+            (earliest == 0 || g_clients[i].deadline < earliest)) {
+            earliest = g_clients[i].deadline;
+        }
+    }
+
+    memset(&spec, 0, sizeof(spec));
+
+    if (earliest != 0) {
+        // An all-zero it_value would disarm the timer instead.
+        wakeup = earliest > SPIN_WAIT_US ? earliest - SPIN_WAIT_US : 1;
+        spec.it_value.tv_sec = wakeup / 1000000;
+        spec.it_value.tv_nsec = (wakeup % 1000000) * 1000;
+    }
+
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+
+    return earliest;
+}
+
+/**
+ * 更新客户端在 epoll 中关注的事件，缓冲区满或回复积压时暂停读取，有未写出的回复时等待可写
+ * @param epoll_fd
+ * @param client
+ */
+static void update_client_events(int epoll_fd, client_t *client) {
+    struct epoll_event event;
+    int paused = client->end == sizeof(client->buffer) - 1 || client_backlogged(client);
+    int writing = client->output_len > 0;
+
+    if ((paused == client->paused && writing == client->writing) || client->closing) {
+        return;
+    }
+
+    client->paused = paused;
+    client->writing = writing;
+    event.events = (paused ? 0 : EPOLLIN) | (writing ? EPOLLOUT : 0);
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+static void disconnect_client(int epoll_fd, client_t *client, internal_state_touchpad_t *state) {
+    int client_fd = client->fd;
+
+    if (!client->closing) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+    }
+
+    client_detach_ring(epoll_fd, client);
+    client_close_passed_fds(client);
+    client_close(client, state);
+
+    // Whatever the socket takes now, e.g. after a half close.
+    client_flush(client);
+    close(client_fd);
+    fprintf(stderr, "Connection closed\n");
+}
+
+/**
+ * 执行所有等待已到期的客户端，按到期时间先后执行
+ * @param epoll_fd
+ * @param state
+ */
+static void run_due_clients(int epoll_fd, internal_state_touchpad_t *state) {
+    client_t *next;
+    int i;
+
+    while (1) {
+        next = NULL;
+
+        for (i = 0; i < MAX_CLIENTS; ++i) {
+            if (g_clients[i].fd >= 0 && g_clients[i].waiting &&
+                (next == NULL || g_clients[i].deadline < next->deadline)) {
+                next = &g_clients[i];
+            }
+        }
+
+        if (next == NULL || next->deadline > now_us() + SPIN_WAIT_US) {
+            return;
+        }
+
+        sleep_until(next->deadline);
+
+        if (!client_process(next, state) && next->closing) {
+            disconnect_client(epoll_fd, next, state);
+        } else {
+            update_client_events(epoll_fd, next);
+        }
+    }
+}
+
+/**
+ * 有被推迟的帧时，让定时器在被推迟的设备中最早的 pace_next 到期
+ * @param pace_fd
+ * @param state
+ */
+static void arm_pace_timer(int pace_fd, internal_state_touchpad_t *state) {
+    struct itimerspec spec;
+    internal_state_touchpad_t *device;
+    uint64_t next = 0;
+    int pending = 0;
+    int i;
+
+    // Only held devices count, the pace_next of any other is long past.
+    for (i = 0; i < g_touch_device_count; ++i) {
+        device = touch_device(state, i);
+
+        if (device->frame_held && (!pending || device->pace_next < next)) {
+            next = device->pace_next;
+            pending = 1;
+        }
+    }
+
+    if (!pending) {
+        // The frame a client stalled on may have gone out early for a
+        // gesture, then a single tick right away resumes it.
+        pending = g_input_client.stalled;
+
+        for (i = 0; i < MAX_CLIENTS && !pending; ++i) {
+            pending = g_clients[i].fd >= 0 && g_clients[i].stalled;
+        }
+
+        if (!pending) {
+            return;
+        }
+
+        next = now_ns();
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = next / 1000000000;
+    spec.it_value.tv_nsec = next % 1000000000;
+    timerfd_settime(pace_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * 到了 pace_next 时写出被推迟的帧，再继续执行因此暂停的客户端
+ * @param epoll_fd
+ * @param state
+ */
+static void run_pace_tick(int epoll_fd, internal_state_touchpad_t *state) {
+    internal_state_touchpad_t *device;
+    client_t *client;
+    uint64_t now = now_ns();
+    int i;
+
+    for (i = 0; i < g_touch_device_count; ++i) {
+        device = touch_device(state, i);
+
+        if (device->pace_next <= now) {
+            write_held_frame(device);
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        client = &g_clients[i];
+
+        // A stall waits for the frame of the device it was stopped on.
+        if (client->fd < 0 || !client->stalled ||
+            touch_device(state, client->device)->frame_held) {
+            continue;
+        }
+
+        client->stalled = 0;
+        client_apply(client, &client->held, state);
+
+        if (!client_process(client, state) && client->closing) {
+            disconnect_client(epoll_fd, client, state);
+        } else {
+            update_client_events(epoll_fd, client);
+        }
+    }
+
+    if (g_input_client.stalled && !touch_device(state, g_input_client.device)->frame_held) {
+        g_input_client.stalled = 0;
+        client_apply(&g_input_client, &g_input_client.held, state);
+        run_queued_commands(state);
+    }
+}
+
+/**
+ * 查找 epoll 事件中的共享内存队列所属的客户端
+ * @param ptr epoll 事件的 data.ptr
+ * @return 不是共享内存队列的事件时返回 NULL
+ */
+static client_t *ring_client(void *ptr) {
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        if (ptr == &g_clients[i].ring) {
+            return &g_clients[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 客户端刚映射了共享内存队列时，把它的 eventfd 加入 epoll
+ * @param epoll_fd
+ * @param client
+ */
+static void watch_client_ring(int epoll_fd, client_t *client) {
+    struct epoll_event event;
+
+    if (client->ring.header == NULL || client->ring.watched) {
+        return;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &client->ring;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->ring.event_fd, &event);
+    client->ring.watched = 1;
+}
+
+/**
+ * 接受一个新连接并加入 epoll
+ * @param epoll_fd
+ * @param listen_fd
+ * @param tcp 是否是 TCP 连接
+ * @param state
+ */
+static void accept_client(int epoll_fd, int listen_fd, int tcp, internal_state_touchpad_t *state) {
+    struct epoll_event event;
+    client_t *client;
+    int no_delay = 1;
+    int client_fd = accept(listen_fd, NULL, NULL);
+
+    if (client_fd < 0) {
+        perror("accepting client");
+        return;
+    }
+
+    // Commands are tiny and latency is all that matters, don't let Nagle
+    // hold back the header, stats or acknowledgements.
+    if (tcp) {
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    }
+
+    client = client_open(client_fd, client_fd, state);
+
+    if (client == NULL) {
+        fprintf(stderr, "Too many clients, rejecting connection\n");
+        close(client_fd);
+        return;
+    }
+
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    client->socket = !tcp;
+
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+
+    fprintf(stderr, "Connection established\n");
+}
+
+/**
+ * 使用 epoll 同时服务多个 socket 客户端
+ * @param server_fd
+ * @param tcp_fd TCP 监听的 fd，-1 表示没有
+ * @param state
+ */
+static void serve(int server_fd, int tcp_fd, internal_state_touchpad_t *state) {
+    struct epoll_event event;
+    struct epoll_event events[MAX_SERVE_EVENTS];
+    int epoll_fd = epoll_create(MAX_SERVE_EVENTS);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    int pace_fd = state->pace_period != 0 ? timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK) : -1;
+    uint64_t expirations;
+    int count;
+    int i;
+
+    if (epoll_fd < 0 || timer_fd < 0 || (state->pace_period != 0 && pace_fd < 0)) {
+        perror("epoll_create/timerfd_create");
+        exit(1);
+    }
+
+    if (pace_fd >= 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &pace_fd; // -P 的帧定时器
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pace_fd, &event);
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // NULL 表示服务端 socket
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+
+    if (tcp_fd >= 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &tcp_fd; // TCP 监听
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tcp_fd, &event);
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &timer_fd; // 定时器，用于唤醒等待中的客户端
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &g_commands; // 其他线程放入的指令
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, g_commands.event_fd, &event);
+
+    while (1) { //监听socket客户端发送的消息
+        dump_stats_if_requested();
+        arm_timer(timer_fd);
+
+        if (pace_fd >= 0) {
+            arm_pace_timer(pace_fd, state);
+        }
+
+        // Replies may have piled up anywhere, e.g. acks for a paced frame.
+        for (i = 0; i < MAX_CLIENTS; ++i) {
+            if (g_clients[i].fd >= 0) {
+                update_client_events(epoll_fd, &g_clients[i]);
+            }
+        }
+
+        count = epoll_wait(epoll_fd, events, MAX_SERVE_EVENTS, -1);
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (i = 0; i < count; ++i) {
+            client_t *client = events[i].data.ptr;
+
+            if (events[i].data.ptr == &timer_fd) {
+                read(timer_fd, &expirations, sizeof(expirations));
+                continue;
+            }
+
+            if (events[i].data.ptr == &g_commands) {
+                run_queued_commands(state);
+                continue;
+            }
+
+            if (events[i].data.ptr == &pace_fd) {
+                read(pace_fd, &expirations, sizeof(expirations));
+                run_pace_tick(epoll_fd, state);
+                continue;
+            }
+
+            if ((client = ring_client(events[i].data.ptr)) != NULL) {
+                // The client may have gone away earlier in this batch.
+                if (client->ring.header == NULL) {
+                    continue;
+                }
+
+                read(client->ring.event_fd, &expirations, sizeof(expirations));
+
+                // While waiting, run_due_clients gets to the ring in time.
+                if (!client->waiting) {
+                    client->received = now_us();
+                    client_process(client, state);
+                }
+                continue;
+            }
+
+            client = events[i].data.ptr;
+
+            if (client == NULL || events[i].data.ptr == &tcp_fd) {
+                accept_client(epoll_fd, client == NULL ? server_fd : tcp_fd, client != NULL, state);
+                continue;
+            }
+
+            if (client->fd < 0 || client->closing) {
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                client_flush(client);
+
+                // Commands held back by the backlog can go on now.
+                if (!client_backlogged(client)) {
+                    client_process(client, state);
+                }
+
+                if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    continue;
+                }
+            }
+
+            ssize_t result = client_read(client, state);
+
+            if (result == 0 || (result < 0 && errno != EAGAIN && errno != EINTR)) {
+                if (client->waiting || client->stalled) {
+                    // Play out whatever the client queued up before hanging up.
+                    client->closing = 1;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+                } else {
+                    disconnect_client(epoll_fd, client, state);
+                }
+                continue;
+            }
+
+            update_client_events(epoll_fd, client);
+            watch_client_ring(epoll_fd, client);
+        }
+
+        run_due_clients(epoll_fd, state);
+    }
+}
+
+/**
+ * 把映射出的指令放进指令队列，由注入线程执行
+ * @param op
+ * @param contact
+ * @param x
+ * @param y
+ * @param pressure
+ */
+static void queue_touch_command(char op, long contact, long x, long y, long pressure) {
+    command_t command;
+
+    memset(&command, 0, sizeof(command));
+    command.op = op;
+    command.contact = contact;
+    command.x = x;
+    command.y = y;
+    command.pressure = pressure;
+    command.received = now_us();
+
+    if (command_queue_push(&g_commands, &command) < 0) {
+        fprintf(stderr, "Command queue is full, dropping '%c'\n", op);
+        return;
+    }
+
+    if (op != 'c') {
+        g_input_pending = 1;
+    }
+}
+
+/**
+ * 如果映射出了新的指令，放入一条提交指令，使它们在同一帧内生效
+ */
+static void commit_input_commands(void) {
+    if (g_input_pending) {
+        g_input_pending = 0;
+        queue_touch_command('c', 0, 0, 0, 0);
+    }
+}
+
+static void
+print_event(struct input_event *ev, const struct libevdev *evdev) {
+    if (ev->type == EV_SYN){
+        commit_input_commands();
+        if (g_verbose)
+            fprintf(stderr, "Event: time %ld.%06ld, ++++++++++++++++++++ %s +++++++++++++++\n",
+                    ev->time.tv_sec,
+                    ev->time.tv_usec,
+                    libevdev_event_type_get_name(ev->type));
+    }else{
+        if (ev->type == EV_REL) {
+            mappingMouseEvent(ev);
+        } else if (ev->type == EV_ABS) {
+            mappingGamepadEvent(ev, evdev);
+        } else {
+            mappingKeyboardEvent(ev);
+        }
+        if (g_verbose)
+            fprintf(stderr, "Event: time %ld.%06ld, type %d (%s), code %d (%s), value %d\n",
+                    ev->time.tv_sec,
+                    ev->time.tv_usec,
+                    ev->type,
+                    libevdev_event_type_get_name(ev->type),
+                    ev->code,
+                    libevdev_event_code_get_name(ev->type, ev->code),
+                    ev->value);
+    }
+}
+
+static void
+print_sync_event(struct input_event *ev, const struct libevdev *evdev) {
+    if (g_verbose)
+        fprintf(stderr, "SYNC: ");
+    print_event(ev, evdev);
+}
+
+/**
+ * 读完输入源设备当前所有可读的事件，每次从 libevdev 批量取一组事件，一组只对应一次 read
+ * @param source
+ * @return 0 正常，-1 设备已不可用
+ */
+static int read_source_device(internal_state_keyboard_t *source) {
+    struct input_event events[SOURCE_EVENT_BATCH];
+    size_t count;
+    size_t i;
+    int rc;
+
+    for (;;) {
+        rc = libevdev_next_events(source->evdev, LIBEVDEV_READ_FLAG_NORMAL,
+                                  events, SOURCE_EVENT_BATCH, &count);
+
+        for (i = 0; i < count; ++i) {
+            print_event(&events[i], source->evdev);
+        }
+
+        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+            // 最后一个是 SYN_DROPPED，内核缓冲溢出过，取回丢失的状态变化
+            if (g_verbose) {
+                fprintf(stderr, "::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
+            }
+            do {
+                rc = libevdev_next_events(source->evdev, LIBEVDEV_READ_FLAG_SYNC,
+                                          events, SOURCE_EVENT_BATCH, &count);
+                for (i = 0; i < count; ++i) {
+                    print_sync_event(&events[i], source->evdev);
+                }
+            } while (rc == LIBEVDEV_READ_STATUS_SYNC);
+            if (g_verbose) {
+                fprintf(stderr, "::::::::::::::::::::: re-synced ::::::::::::::::::::::\n");
+            }
+        } else if (rc == -EAGAIN) {
+            return 0;
+        } else if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EINTR) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * 解析按键名称，支持 KEY_A、BTN_LEFT 这样的完整名称、省略 KEY_ 的 A，以及数字键码
+ * @param name
+ * @return 键码，无法识别时返回 -1
+ */
+static int parse_key_code(const char *name) {
+    char full_name[68];
+    char *end;
+    long code = strtol(name, &end, 10);
+
+    if (end != name && *end == '\0') {
+        return code > 0 && code < KEY_CNT ? code : -1;
+    }
+
+    if ((code = libevdev_event_code_from_name(EV_KEY, name)) >= 0) {
+        return code;
+    }
+
+    snprintf(full_name, sizeof(full_name), "KEY_%s", name);
+
+    return libevdev_event_code_from_name(EV_KEY, full_name);
+}
+
+/**
+ * 读取并编译映射文件，每行一个按键：
+ *
+ *   tap   <key> <x> <y> [ms]
+ *   hold  <key> <x> <y>
+ *   swipe <key> <x0> <y0> <x1> <y1> <ms>
+ *   mouse <x> <y> <radius>
+ *   wheel <x> <y> <step>
+ *   stick <left|right> <x> <y> <radius> [deadzone%]
+ *
+ * @param path
+ * @return 新的映射表，文件有错误时返回 NULL
+ */
+static keymap_t *load_keymap(const char *path) {
+    FILE *file = fopen(path, "r");
+    keymap_t *keymap;
+    key_action_t *action;
+    char line[256];
+    char type[16];
+    char key[64];
+    char *cursor;
+    long values[6];
+    int line_number = 0;
+    int offset;
+    int code;
+    int count;
+
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open key map '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    keymap = calloc(1, sizeof(*keymap));
+
+    if (keymap == NULL) {
+        fprintf(stderr, "Unable to allocate key map\n");
+        fclose(file);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number += 1;
+        cursor = line + strspn(line, " \t");
+
+        if (*cursor == '#' || *cursor == '\n' || *cursor == '\r' || *cursor == '\0') {
+            continue;
+        }
+
+        if (sscanf(cursor, "%15s%n", type, &offset) != 1) {
+            goto invalid;
+        }
+
+        if (strcmp(type, "stick") == 0) {
+            stick_action_t *stick;
+
+            cursor += offset;
+
+            if (sscanf(cursor, "%63s%n", key, &offset) != 1 ||
+                (strcmp(key, "left") != 0 && strcmp(key, "right") != 0)) {
+                goto invalid;
+            }
+
+            cursor += offset;
+            count = parse_numbers(&cursor, values, 4);
+
+            if (count < 3 || values[2] <= 0) {
+                goto invalid;
+            }
+
+            stick = &keymap->sticks[key[0] == 'r'];
+            stick->enabled = 1;
+            stick->x = values[0];
+            stick->y = values[1];
+            stick->radius = values[2];
+            stick->deadzone = count == 4 ? values[3] : DEFAULT_STICK_DEADZONE;
+            continue;
+        }
+
+        if (strcmp(type, "mouse") == 0 || strcmp(type, "wheel") == 0) {
+            cursor += offset;
+
+            if (parse_numbers(&cursor, values, 3) < 3 || values[2] <= 0) {
+                goto invalid;
+            }
+
+            if (type[0] == 'm') {
+                keymap->mouse.enabled = 1;
+                keymap->mouse.x = values[0];
+                keymap->mouse.y = values[1];
+                keymap->mouse.radius = values[2];
+            } else {
+                keymap->wheel.enabled = 1;
+                keymap->wheel.x = values[0];
+                keymap->wheel.y = values[1];
+                keymap->wheel.step = values[2];
+            }
+            continue;
+        }
+
+        if (sscanf(cursor, "%15s %63s%n", type, key, &offset) != 2) {
+            goto invalid;
+        }
+
+        if ((code = parse_key_code(key)) <= 0) {
+            fprintf(stderr, "%s:%d: unknown key '%s'\n", path, line_number, key);
+            goto error;
+        }
+
+        action = &keymap->actions[code];
+        cursor += offset;
+        count = parse_numbers(&cursor, values, 6);
+
+        if (strcmp(type, "tap") == 0 && (count == 2 || count == 3)) {
+            action->type = KEY_ACTION_TAP;
+            action->duration = count == 3 ? values[2] * 1000 : TAP_DURATION_US;
+        } else if (strcmp(type, "hold") == 0 && count == 2) {
+            action->type = KEY_ACTION_HOLD;
+        } else if (strcmp(type, "swipe") == 0 && count == 5 && values[4] > 0) {
+            action->type = KEY_ACTION_SWIPE;
+            action->x1 = values[2];
+            action->y1 = values[3];
+            action->duration = values[4] * 1000;
+        } else {
+            goto invalid;
+        }
+
+        action->x0 = values[0];
+        action->y0 = values[1];
+    }
+
+    fclose(file);
+
+    return keymap;
+
+    invalid:
+    fprintf(stderr, "%s:%d: invalid mapping\n", path, line_number);
+
+    error:
+    fclose(file);
+    free(keymap);
+
+    return NULL;
+}
+
+/**
+ * 没有指定映射文件时使用的映射：按住 A、D 分别按住两个固定的点
+ * @return 内存不足时返回 NULL
+ */
+static keymap_t *default_keymap(void) {
+    keymap_t *keymap = calloc(1, sizeof(*keymap));
+
+    if (keymap == NULL) {
+        fprintf(stderr, "Unable to allocate key map\n");
+        return NULL;
+    }
+
+    keymap->actions[KEY_A].type = KEY_ACTION_HOLD;
+    keymap->actions[KEY_A].x0 = 230;
+    keymap->actions[KEY_A].y0 = 491;
+    keymap->actions[KEY_D].type = KEY_ACTION_HOLD;
+    keymap->actions[KEY_D].x0 = 230;
+    keymap->actions[KEY_D].y0 = 732;
+
+    return keymap;
+}
+
+/**
+ * 映射文件有变化时重新加载，新文件有错误时继续使用原来的映射
+ */
+static void reload_keymap(void) {
+    keymap_t *keymap = load_keymap(g_keymap_file);
+
+    if (keymap == NULL) {
+        fprintf(stderr, "Keeping the previous key map\n");
+        return;
+    }
+
+    // Only this thread ever reads g_keymap, and running actions keep their
+    // own copy, so swapping the pointer is all there is to it.
+    free(g_keymap);
+    g_keymap = keymap;
+    fprintf(stderr, "Reloaded key map from %s\n", g_keymap_file);
+}
+
+/**
+ * 开启或关闭输入线程的帧定时器，只有 tap、swipe 进行中时才需要
+ * @param enabled
+ */
+static void set_input_timer(int enabled) {
+    struct itimerspec spec;
+
+    if (enabled == g_input_timer_armed) {
+        return;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+
+    if (enabled) {
+        // -r 1 is a whole second, which tv_nsec alone can't hold.
+        long long period = 1000000000LL / g_frame_rate;
+
+        spec.it_interval.tv_sec = period / 1000000000LL;
+        spec.it_interval.tv_nsec = period % 1000000000LL;
+        spec.it_value = spec.it_interval;
+    }
+
+    // Left unarmed on failure, so the next call tries again.
+    if (timerfd_settime(g_input_timer_fd, 0, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+        return;
+    }
+
+    g_input_timer_armed = enabled;
+}
+
+static int find_key_contact(int key) {
+    int contact;
+
+    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+        if (g_input_contacts[contact].key == key) {
+            return contact;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * 每帧推进进行中的 tap、swipe
+ * @param now
+ * @return 是否还有进行中的 tap、swipe
+ */
+static int run_key_actions(uint64_t now) {
+    int contact;
+    int running = 0;
+
+    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+        input_contact_t *input = &g_input_contacts[contact];
+        const key_action_t *action = &input->action;
+        uint64_t end = input->start + action->duration;
+
+        if (action->type != KEY_ACTION_TAP && action->type != KEY_ACTION_SWIPE) {
+            continue;
+        }
+
+        if (action->type == KEY_ACTION_SWIPE) {
+            double t = now >= end ? 1.0 : (double) (now - input->start) / action->duration;
+
+            queue_touch_command('m', contact,
+                                lround(action->x0 + (action->x1 - action->x0) * t),
+                                lround(action->y0 + (action->y1 - action->y0) * t),
+                                KEYMAP_PRESSURE);
+        }
+
+        if (now >= end) {
+            // Done for good, later ticks must not lift it again.
+            queue_touch_command('u', contact, 0, 0, 0);
+            input->key = 0;
+            input->action.type = KEY_ACTION_NONE;
+        } else {
+            running = 1;
+        }
+    }
+
+    return running;
+}
+
+/**
+ * 占用一个空闲的逻辑触控点
+ * @param owner INPUT_OWNER_*
+ * @return 逻辑触控点，没有空闲时返回 -1
+ */
+static int acquire_input_contact(int owner) {
+    int contact = find_key_contact(0);
+
+    if (contact >= 0) {
+        memset(&g_input_contacts[contact], 0, sizeof(g_input_contacts[contact]));
+        g_input_contacts[contact].key = owner;
+    }
+
+    return contact;
+}
+
+static void release_input_contact(int contact) {
+    queue_touch_command('u', contact, 0, 0, 0);
+    g_input_contacts[contact].key = 0;
+}
+
+/**
+ * 每帧把累计的鼠标移动合并成一次拖动
+ * @param now
+ * @return 拖动是否还在进行
+ */
+static int run_mouse_action(uint64_t now) {
+    const mouse_action_t *mouse = &g_keymap->mouse;
+
+    if (g_mouse.contact >= 0 && (g_mouse.lift || !mouse->enabled ||
+                                 now - g_mouse.last_motion >= MOUSE_IDLE_US)) {
+        release_input_contact(g_mouse.contact);
+        g_mouse.contact = -1;
+        g_mouse.lift = 0;
+        // Motion that came in meanwhile starts the next drag.
+        return g_mouse.dx != 0 || g_mouse.dy != 0;
+    }
+
+    if (!mouse->enabled || (g_mouse.dx == 0 && g_mouse.dy == 0)) {
+        g_mouse.dx = 0;
+        g_mouse.dy = 0;
+        return g_mouse.contact >= 0;
+    }
+
+    if (g_mouse.contact < 0) {
+        // Put the finger down first and move it from the next frame on,
+        // otherwise the motion would be lost in the down itself.
+        if ((g_mouse.contact = acquire_input_contact(INPUT_OWNER_MOUSE)) < 0) {
+            g_mouse.dx = 0;
+            g_mouse.dy = 0;
+            return 0;
+        }
+
+        g_mouse.x = mouse->x;
+        g_mouse.y = mouse->y;
+        queue_touch_command('d', g_mouse.contact, g_mouse.x, g_mouse.y, KEYMAP_PRESSURE);
+        return 1;
+    }
+
+    g_mouse.x += g_mouse.dx;
+    g_mouse.y += g_mouse.dy;
+    g_mouse.dx = 0;
+    g_mouse.dy = 0;
+    queue_touch_command('m', g_mouse.contact, g_mouse.x, g_mouse.y, KEYMAP_PRESSURE);
+
+    if (hypot(g_mouse.x - mouse->x, g_mouse.y - mouse->y) > mouse->radius) {
+        g_mouse.lift = 1;
+    }
+
+    return 1;
+}
+
+static void queue_wheel_contacts(char op) {
+    const wheel_action_t *wheel = &g_keymap->wheel;
+
+    queue_touch_command(op, g_wheel.contacts[0], wheel->x - g_wheel.spread / 2, wheel->y,
+                        KEYMAP_PRESSURE);
+    queue_touch_command(op, g_wheel.contacts[1], wheel->x + g_wheel.spread / 2, wheel->y,
+                        KEYMAP_PRESSURE);
+}
+
+/**
+ * 每帧让两指间距向滚轮累计出的目标间距靠近，停止滚动一段时间后抬起
+ * @param now
+ * @return 缩放是否还在进行
+ */
+static int run_wheel_action(uint64_t now) {
+    const wheel_action_t *wheel = &g_keymap->wheel;
+    int speed = wheel->step / WHEEL_STEP_FRAMES > 0 ? wheel->step / WHEEL_STEP_FRAMES : 1;
+    int diff = g_wheel.target - g_wheel.spread;
+
+    if (g_wheel.contacts[0] < 0) {
+        return 0;
+    }
+
+    if (wheel->enabled && diff != 0) {
+        g_wheel.spread += diff > 0 ? (diff < speed ? diff : speed) : (-diff < speed ? diff : -speed);
+        g_wheel.last = now;
+        queue_wheel_contacts('m');
+        return 1;
+    }
+
+    if (wheel->enabled && now - g_wheel.last < WHEEL_IDLE_US) {
+        return 1;
+    }
+
+    release_input_contact(g_wheel.contacts[0]);
+    release_input_contact(g_wheel.contacts[1]);
+    g_wheel.contacts[0] = -1;
+    g_wheel.contacts[1] = -1;
+
+    return 0;
+}
+
+/**
+ * 处理滚轮滚动，向上滚动两指张开（放大），向下滚动两指合拢（缩小）
+ * @param notches
+ */
+static void scroll_wheel(int notches) {
+    const wheel_action_t *wheel = &g_keymap->wheel;
+
+    if (!wheel->enabled) {
+        return;
+    }
+
+    if (g_wheel.contacts[0] < 0) {
+        if ((g_wheel.contacts[0] = acquire_input_contact(INPUT_OWNER_WHEEL)) < 0) {
+            return;
+        }
+
+        if ((g_wheel.contacts[1] = acquire_input_contact(INPUT_OWNER_WHEEL)) < 0) {
+            g_input_contacts[g_wheel.contacts[0]].key = 0;
+            g_wheel.contacts[0] = -1;
+            return;
+        }
+
+        g_wheel.spread = wheel->step * WHEEL_START_STEPS;
+        g_wheel.target = g_wheel.spread;
+        queue_wheel_contacts('d');
+    }
+
+    g_wheel.target += notches * wheel->step;
+
+    if (g_wheel.target < wheel->step) {
+        g_wheel.target = wheel->step;
+    }
+
+    g_wheel.last = now_us();
+}
+
+static void mappingMouseEvent(struct input_event *pEvent) {
+    // 移动只累计下来，由帧定时器每帧合并成一次拖动，不会按鼠标的上报频率发送
+    switch (pEvent->code) {
+        case REL_X:
+            g_mouse.dx += pEvent->value;
+            g_mouse.last_motion = now_us();
+            break;
+        case REL_Y:
+            g_mouse.dy += pEvent->value;
+            g_mouse.last_motion = now_us();
+            break;
+        case REL_WHEEL:
+            scroll_wheel(pEvent->value);
+            break;
+        default:
+            return;
+    }
+
+    set_input_timer(1);
+}
+
+/**
+ * 每帧把摇杆的最新位置映射到虚拟摇杆上，只在位置变化时发出指令
+ * @param index 0 左摇杆，1 右摇杆
+ * @return 下一帧是否还需要处理
+ */
+static int run_stick_action(int index) {
+    const stick_action_t *action = &g_keymap->sticks[index];
+    stick_state_t *stick = &g_sticks[index];
+    double magnitude = hypot(stick->dx, stick->dy);
+    double scale;
+    long x;
+    long y;
+
+    if (!stick->dirty && (stick->contact < 0 || action->enabled)) {
+        return 0;
+    }
+
+    stick->dirty = 0;
+
+    if (!action->enabled || magnitude * 100 < action->deadzone) {
+        if (stick->contact >= 0) {
+            release_input_contact(stick->contact);
+            stick->contact = -1;
+        }
+        return 0;
+    }
+
+    if (stick->contact < 0) {
+        // On-screen joysticks take their origin from where the finger lands,
+        // so land on the center and only move out on the next frame.
+        if ((stick->contact = acquire_input_contact(INPUT_OWNER_STICK)) < 0) {
+            return 0;
+        }
+
+        stick->x = action->x;
+        stick->y = action->y;
+        queue_touch_command('d', stick->contact, stick->x, stick->y, KEYMAP_PRESSURE);
+        stick->dirty = 1;
+        return 1;
+    }
+
+    // Diagonals would otherwise reach past the radius on square gates.
+    scale = magnitude > 1 ? 1 / magnitude : 1;
+    x = lround(action->x + stick->dx * scale * action->radius);
+    y = lround(action->y + stick->dy * scale * action->radius);
+
+    if (x != stick->x || y != stick->y) {
+        stick->x = x;
+        stick->y = y;
+        queue_touch_command('m', stick->contact, x, y, KEYMAP_PRESSURE);
+    }
+
+    return 0;
+}
+
+static void mappingGamepadEvent(struct input_event *pEvent, const struct libevdev *evdev) {
+    // 摇杆只记录最新位置，由帧定时器每帧最多发出一次
+    stick_state_t *stick;
+    double *axis;
+    int minimum;
+    int maximum;
+
+    switch (pEvent->code) {
+        case ABS_X:
+            stick = &g_sticks[0];
+            axis = &stick->dx;
+            break;
+        case ABS_Y:
+            stick = &g_sticks[0];
+            axis = &stick->dy;
+            break;
+        case ABS_RX:
+            stick = &g_sticks[1];
+            axis = &stick->dx;
+            break;
+        case ABS_RY:
+            stick = &g_sticks[1];
+            axis = &stick->dy;
+            break;
+        default:
+            return;
+    }
+
+    minimum = libevdev_get_abs_minimum(evdev, pEvent->code);
+    maximum = libevdev_get_abs_maximum(evdev, pEvent->code);
+
+    if (maximum <= minimum) {
+        return;
+    }
+
+    *axis = 2.0 * (pEvent->value - minimum) / (maximum - minimum) - 1;
+    stick->dirty = 1;
+    set_input_timer(1);
+}
+
+static void mappingKeyboardEvent(struct input_event *pEvent) {
+    //当触发指定按键时，发送相应的多点触控指令，映射关系见 load_keymap
+    if (pEvent->type != EV_KEY || pEvent->code >= KEY_CNT) {
+        return;
+    }
+
+    int action = pEvent->value;
+    switch (action) {
+        case 0: //action_up
+            dealWithActionUp(pEvent);
+            break;
+        case 1://action_down
+            dealWithActionDown(pEvent);
+            break;
+    }
+}
+
+
+static void dealWithActionUp(struct input_event *pEvent) {
+    int contact = find_key_contact(pEvent->code);
+
+    // tap 和 swipe 按下即完整执行，与何时松开无关
+    if (contact < 0 || g_input_contacts[contact].action.type != KEY_ACTION_HOLD) {
+        return;
+    }
+
+    queue_touch_command('u', contact, 0, 0, 0);
+    g_input_contacts[contact].key = 0;
+}
+
+
+/**
+ * 处理按下事件，直接用键码查映射表
+ * @param pEvent
+ */
+static void dealWithActionDown(struct input_event *pEvent) {
+    const key_action_t *action = &g_keymap->actions[pEvent->code];
+    int contact;
+
+    if (action->type == KEY_ACTION_NONE || find_key_contact(pEvent->code) >= 0) {
+        return;
+    }
+
+    if ((contact = find_key_contact(0)) < 0) {
+        if (g_verbose)
+            fprintf(stderr, "No free contact for key %d\n", pEvent->code);
+        return;
+    }
+
+    g_input_contacts[contact].key = pEvent->code;
+    g_input_contacts[contact].action = *action;
+    g_input_contacts[contact].start = now_us();
+
+    queue_touch_command('d', contact, action->x0, action->y0, KEYMAP_PRESSURE);
+
+    if (action->type != KEY_ACTION_HOLD) {
+        set_input_timer(1);
+    }
+}
+
+
+
+/**
+ * 开始读取输入源设备
+ * @param epoll_fd
+ * @param source
+ */
+static void watch_source_device(int epoll_fd, internal_state_keyboard_t *source) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+/**
+ * 停止读取输入源设备并释放它
+ * @param epoll_fd
+ * @param source
+ */
+static void unwatch_source_device(int epoll_fd, internal_state_keyboard_t *source) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+    remove_source_device(source);
+}
+
+/**
+ * 触控设备出现或消失后，让注入线程按设备表重新选择触控设备
+ */
+static void request_touch_switch(void) {
+    command_t command;
+
+    if (!g_touch_hotplug) {
+        return;
+    }
+
+    memset(&command, 0, sizeof(command));
+    command.op = 'H';
+    command_queue_push(&g_commands, &command);
+    command_queue_notify(&g_commands);
+}
+
+/**
+ * 新设备节点出现时只探测这一个节点并加入设备表。netlink 和 inotify 都会报告同一个节点，
+ * 已经在设备表中的节点直接忽略
+ * @param epoll_fd
+ * @param dev_path
+ */
+static void on_device_added(int epoll_fd, const char *dev_path) {
+    device_probe_t probe;
+    internal_state_keyboard_t *source;
+    int score = -1;
+    int type;
+    int fd;
+
+    // The uevent may well be faster than ueventd creating the node, inotify
+    // reports it again once it's there.
+    if (registered_serial(dev_path) != 0 || access(dev_path, F_OK) < 0) {
+        return;
+    }
+
+    if ((fd = open_and_probe_device(dev_path, &probe, &type)) < 0) {
+        return;
+    }
+
+    if (type & DEVICE_TOUCH) {
+        score = score_touch_device(dev_path, &probe);
+    }
+
+    register_device(dev_path, type, score);
+    fprintf(stderr, "on device added:%s,", dev_path);
+
+    if (score >= 0) {
+        // The injecting thread opens it itself if it wins.
+        fprintf(stderr, "and it's a touch device (score %d)\n", score);
+        close(fd);
+        request_touch_switch();
+    } else if ((source = add_source_probe(dev_path, fd, &probe)) != NULL) { //找到设备
+        fprintf(stderr, "and it's an input device\n");
+        watch_source_device(epoll_fd, source);
+    } else { //未找到设备
+        fprintf(stderr, "but it's not an input device we use\n");
+        close(fd);
+    }
+}
+
+static void on_device_removed(int epoll_fd, const char *dev_path) {
+    //有设备移除
+    int type = unregister_device(dev_path);
+    int i;
+
+    if (type < 0) {
+        return;
+    }
+
+    fprintf(stderr, "on device removed: %s\n", dev_path);
+
+    if (type & DEVICE_TOUCH) {
+        request_touch_switch();
+    }
+
+    for (i = 0; i < MAX_SOURCE_DEVICES; ++i) {
+        if (g_sources[i].evdev != NULL && strcmp(g_sources[i].path, dev_path) == 0) {
+            unwatch_source_device(epoll_fd, &g_sources[i]);
+        }
+    }
+}
+
+/**
+ * 处理 inotify 读到的设备目录和映射文件的变化
+ * @param fd
+ * @param epoll_fd
+ * @param devroot
+ */
+static void read_inotify_events(int fd, int epoll_fd, const char *devroot) {
+    char buf[BUFSIZ] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    char dev_path[FILENAME_MAX];
+    int len;
+    int nread;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        nread = 0;
+        while (nread < len) {
+            event = (struct inotify_event *) &buf[nread];
+            if (event->wd == g_keymap_wd) {
+                // Editors often write a new file and rename it over the old one.
+                if (event->len > 0 && strcmp(event->name, g_keymap_name) == 0) {
+                    reload_keymap();
+                }
+            } else if (event->len > 0) {
+                snprintf(dev_path, sizeof(dev_path), "%s/%s", devroot, event->name);
+
+                if (event->mask & IN_CREATE) {
+                    on_device_added(epoll_fd, dev_path);//有设备添加
+                } else if (event->mask & IN_DELETE) {
+                    on_device_removed(epoll_fd, dev_path);//有设备移除
+                }
+            }
+            nread = nread + sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/**
+ * 打开接收内核 uevent 的 netlink socket。shell 用户通常没有权限 bind，这时只用 inotify
+ * @return socket 的 fd，失败时返回 -1
+ */
+static int open_uevent_socket(void) {
+    struct sockaddr_nl addr;
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0) {
+        fprintf(stderr, "Note: unable to open uevent socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // 内核发出的 uevent
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Note: unable to bind uevent socket: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * 处理内核发出的 uevent，只关心 input 子系统中 /dev/input 下的节点。
+ * 消息是 "ACTION@DEVPATH"，之后是以 \0 分隔的 KEY=VALUE
+ * @param fd
+ * @param epoll_fd
+ * @param devroot
+ */
+static void read_uevents(int fd, int epoll_fd, const char *devroot) {
+    char buf[4096];
+    char dev_path[FILENAME_MAX];
+    struct sockaddr_nl sender;
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t len;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf) - 1;
+        msg.msg_name = &sender;
+        msg.msg_namelen = sizeof(sender);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if ((len = recvmsg(fd, &msg, 0)) <= 0) {
+            break;
+        }
+
+        // Any process may send to the group, only believe the kernel.
+        if (sender.nl_pid != 0) {
+            continue;
+        }
+
+        buf[len] = '\0';
+
+        const char *action = NULL;
+        const char *subsystem = NULL;
+        const char *devname = NULL;
+        const char *cursor;
+
+        for (cursor = buf; cursor < buf + len; cursor += strlen(cursor) + 1) {
+            if (strncmp(cursor, "ACTION=", 7) == 0) {
+                action = cursor + 7;
+            } else if (strncmp(cursor, "SUBSYSTEM=", 10) == 0) {
+                subsystem = cursor + 10;
+            } else if (strncmp(cursor, "DEVNAME=", 8) == 0) {
+                devname = cursor + 8;
+            }
+        }
+
+        if (action == NULL || subsystem == NULL || devname == NULL ||
+            strcmp(subsystem, "input") != 0 || strncmp(devname, "input/", 6) != 0) {
+            continue;
+        }
+
+        snprintf(dev_path, sizeof(dev_path), "%s/%s", devroot, devname + 6);
+
+        if (strcmp(action, "add") == 0) {
+            on_device_added(epoll_fd, dev_path);
+        } else if (strcmp(action, "remove") == 0) {
+            on_device_removed(epoll_fd, dev_path);
+        }
+    }
+}
+
+/**
+ * 输入线程：用一个 epoll 同时等待所有输入源设备和设备目录的变化（inotify），
+ * 热插拔的设备也在这里加入和移除，不再为每个设备单独创建线程
+ * @param arg 设备目录
+ */
+static void *run_input_reactor(void *arg) {
+    const char *devroot = arg;
+    struct epoll_event events[MAX_SOURCE_DEVICES + 3];
+    struct epoll_event event;
+    uint64_t expirations;
+    int epoll_fd;
+    int inotify_fd;
+    int uevent_fd;
+    int i;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        return NULL;
+    }
+
+    for (i = 0; i < MAX_SOURCE_DEVICES; ++i) {
+        if (g_sources[i].evdev != NULL) {
+            watch_source_device(epoll_fd, &g_sources[i]);
+        }
+    }
+
+    // 对设备目录进行监听，监听两个事件：IN_CREATE和IN_DELETE
+    if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "inotify_init failed\n");
+    } else if (inotify_add_watch(inotify_fd, devroot, IN_CREATE | IN_DELETE) < 0) {
+        fprintf(stderr, "inotify_add_watch %s failed\n", devroot);
+    } else {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &event);
+        fprintf(stderr,">>> watching device state change...\n");
+    }
+
+    // uevents report a node as soon as the kernel has it. inotify stays
+    // in place, as on Android the node only appears once ueventd got to it.
+    if ((uevent_fd = open_uevent_socket()) >= 0) {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = &uevent_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uevent_fd, &event);
+    }
+
+    // 映射文件所在目录，文件被改写或替换时重新加载
+    if (inotify_fd >= 0 && g_keymap_file != NULL) {
+        char directory[FILENAME_MAX];
+        char *slash;
+
+        snprintf(directory, sizeof(directory), "%s", g_keymap_file);
+        slash = strrchr(directory, '/');
+        g_keymap_name = slash != NULL ? g_keymap_file + (slash - directory) + 1 : g_keymap_file;
+
+        if (slash == directory) {
+            directory[1] = '\0';
+        } else if (slash != NULL) {
+            *slash = '\0';
+        } else {
+            strcpy(directory, ".");
+        }
+
+        g_keymap_wd = inotify_add_watch(inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+        if (g_keymap_wd < 0) {
+            fprintf(stderr, "inotify_add_watch %s failed\n", directory);
+        }
+    }
+
+    if ((g_input_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create");
+    } else {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = &g_input_timer_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, g_input_timer_fd, &event);
+    }
+
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_SOURCE_DEVICES + 3, -1);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < n; ++i) {
+            internal_state_keyboard_t *source = events[i].data.ptr;
+
+            if (source == NULL) {
+                read_inotify_events(inotify_fd, epoll_fd, devroot);
+                continue;
+            }
+
+            if (events[i].data.ptr == &uevent_fd) {
+                read_uevents(uevent_fd, epoll_fd, devroot);
+                continue;
+            }
+
+            if (events[i].data.ptr == &g_input_timer_fd) {
+                read(g_input_timer_fd, &expirations, sizeof(expirations));
+                uint64_t now = now_us();
+                // Bitwise or, every one of them has to run.
+                set_input_timer(run_key_actions(now) | run_mouse_action(now) |
+                                run_wheel_action(now) | run_stick_action(0) |
+                                run_stick_action(1));
+                commit_input_commands();
+                command_queue_notify(&g_commands);
+                continue;
+            }
+
+            // An earlier event in this batch may have removed it already.
+            if (source->evdev == NULL) {
+                continue;
+            }
+
+            if (read_source_device(source) < 0 ||
+                (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                unwatch_source_device(epoll_fd, source);
+            }
+
+            commit_input_commands();
+
+            command_queue_notify(&g_commands);
+        }
+    }
+
+    close(uevent_fd);
+    close(inotify_fd);
+    close(epoll_fd);
+
+    return NULL;
+}
+
+
+/**
+ * 根据触控设备的能力初始化 state 中的各项参数
+ * @param state
+ */
+static void setup_touch_device(internal_state_touchpad_t *state) {
+    state->has_mtslot =
+            libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_SLOT);
+    state->has_tracking_id =
+            libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_TRACKING_ID);
+    state->has_key_btn_touch =
+            libevdev_has_event_code(state->evdev, EV_KEY, BTN_TOUCH);
+    state->has_touch_major =
+            libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_TOUCH_MAJOR);
+    state->has_width_major =
+            libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_WIDTH_MAJOR);
+
+    state->has_pressure =
+            libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_PRESSURE);
+    state->min_pressure = state->has_pressure ?
+                                  libevdev_get_abs_minimum(state->evdev, ABS_MT_PRESSURE)
+                                                              : 0;
+    state->max_pressure = state->has_pressure ?
+                                  libevdev_get_abs_maximum(state->evdev, ABS_MT_PRESSURE)
+                                                              : 0;
+
+    state->max_x = libevdev_get_abs_maximum(state->evdev, ABS_MT_POSITION_X);
+    state->max_y = libevdev_get_abs_maximum(state->evdev, ABS_MT_POSITION_Y);
+
+    state->max_tracking_id = state->has_tracking_id
+                                     ? libevdev_get_abs_maximum(state->evdev,
+                                                                ABS_MT_TRACKING_ID)
+                                     : INT_MAX;
+
+    if (!state->has_mtslot && state->max_tracking_id == 0) {
+        // The touch device reports incorrect values. There would be no point
+        // in supporting ABS_MT_TRACKING_ID at all if the maximum value was 0
+        // (i.e. one contact). This happens on Lenovo Yoga Tablet B6000-F,
+        // which actually seems to support ~10 contacts. So, we'll just go with
+        // as many as we can and hope that the system will ignore extra contacts.
+        state->max_tracking_id = MAX_SUPPORTED_CONTACTS - 1;
+        fprintf(stderr,
+                "Note: type A device reports a max value of 0 for ABS_MT_TRACKING_ID. "
+                "This means that the device is most likely reporting incorrect "
+                "information. Guessing %d.\n",
+                state->max_tracking_id
+        );
+    }
+
+    state->max_contacts = state->has_mtslot
+                                  ? libevdev_get_abs_maximum(state->evdev, ABS_MT_SLOT) + 1
+                                  : (state->has_tracking_id ?
+                                     state->max_tracking_id + 1 : 2);
+
+    state->tracking_id = 0;
+
+    int contact;  //触控点数量
+    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+        state->contacts[contact].enabled = 0;
+    }
+
+    fprintf(stderr,
+            "%s touch device %s (%dx%d with %d contacts) detected on %s (score %d)\n",
+            state->has_mtslot ? "Type B" : "Type A", //根据触控槽来判断是什么协议类型
+            libevdev_get_name(state->evdev),
+            state->max_x, state->max_y, state->max_contacts,
+            state->path, state->score
+    );
+
+    if (state->max_contacts > MAX_SUPPORTED_CONTACTS) {
+        fprintf(stderr, "Note: hard-limiting maximum number of contacts to %d\n",
+                MAX_SUPPORTED_CONTACTS);
+        state->max_contacts = MAX_SUPPORTED_CONTACTS;
+    }
+}
+
+/**
+ * 创建一个与触控设备参数（absinfo、槽位数等）完全相同的虚拟触控屏，之后的事件都写入它，
+ * 这样注入的事件不会和真实触控驱动的事件交错在同一个设备上。/dev/uinput 不可用时继续直接写入触控设备
+ * @param state
+ * @return 1 使用虚拟设备，0 继续直接写入触控设备
+ */
+static int setup_uinput_device(internal_state_touchpad_t *state) {
+    char name[128];
+    int result;
+
+    snprintf(name, sizeof(name), "%s (minitouch)", libevdev_get_name(state->evdev));
+    libevdev_set_name(state->evdev, name);
+
+    result = libevdev_uinput_create_from_device(state->evdev, LIBEVDEV_UINPUT_OPEN_MANAGED,
+                                                &state->uinput);
+
+    if (result < 0) {
+        fprintf(stderr, "Unable to create uinput device (%s), writing to %s directly\n",
+                strerror(-result), state->path);
+        state->uinput = NULL;
+        return 0;
+    }
+
+    // uinput takes the same batched input_event writes as the evdev node,
+    // so the rest of the injection path doesn't need to know the difference.
+    state->fd = libevdev_uinput_get_fd(state->uinput);
+
+    fprintf(stderr, "Injecting into virtual touch device %s\n",
+            libevdev_uinput_get_devnode(state->uinput) ? libevdev_uinput_get_devnode(state->uinput)
+                                                       : libevdev_uinput_get_syspath(state->uinput));
+
+    return 1;
+}
+
+/**
+ * 打开替代触控设备的输出：null（/dev/null）、memfd 或内存中的 capture 缓冲
+ * @param sink
+ * @param state
+ * @return 0 成功，-1 失败
+ */
+static int open_sink(const char *sink, internal_state_touchpad_t *state) {
+    state->capturing = 0;
+
+    if (strcmp(sink, "null") == 0) {
+        state->fd = open("/dev/null", O_WRONLY);
+    } else if (strcmp(sink, "memfd") == 0) {
+#ifdef __NR_memfd_create
+        state->fd = syscall(__NR_memfd_create, "minitouch-sink", 0);
+#else
+        FILE *file = tmpfile();
+        state->fd = file ? dup(fileno(file)) : -1;
+#endif
+    } else if (strcmp(sink, "capture") == 0) {
+        state->fd = -1;
+        state->capturing = 1;
+        return 0;
+    } else {
+        fprintf(stderr, "Unknown sink '%s'\n", sink);
+        return -1;
+    }
+
+    if (state->fd < 0) {
+        perror("opening sink");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 使用虚拟的触控设备参数代替真实设备，便于在没有触控设备的主机上运行
+ * @param type "a" 或 "b"，即触控协议类型
+ * @param sink 见 open_sink
+ * @param state
+ * @return 0 成功，-1 失败
+ */
+static int setup_fake_device(const char *type, const char *sink, internal_state_touchpad_t *state) {
+    int contact;
+
+    if (strcmp(type, "a") != 0 && strcmp(type, "b") != 0) {
+        fprintf(stderr, "Unknown fake device type '%s'\n", type);
+        return -1;
+    }
+
+    if (open_sink(sink, state) < 0) {
+        return -1;
+    }
+
+    // Loosely modeled after a typical 1080p phone panel.
+    state->has_mtslot = type[0] == 'b';
+    state->has_tracking_id = 1;
+    state->has_key_btn_touch = 1;
+    state->has_touch_major = 1;
+    state->has_width_major = 1;
+    state->has_pressure = 1;
+    state->min_pressure = 0;
+    state->max_pressure = 255;
+    state->max_x = 1079;
+    state->max_y = 1919;
+    state->max_tracking_id = state->has_mtslot ? 65535 : MAX_SUPPORTED_CONTACTS - 1;
+    state->max_contacts = MAX_SUPPORTED_CONTACTS;
+    state->tracking_id = 0;
+    strncpy(state->path, sink, sizeof(state->path) - 1);
+
+    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+        state->contacts[contact].enabled = 0;
+    }
+
+    fprintf(stderr, "Using fake type %s touch device writing to %s\n",
+            state->has_mtslot ? "B" : "A", sink);
+
+    return 0;
+}
+
+/**
+ * 生成基准测试用的指令集
+ * @param corpus taps（单指点击）、chaos（10 指随机按下/移动/抬起）或 swipes（长滑动）
+ * @param output
+ * @return 0 成功，-1 未知的指令集
+ */
+static int write_corpus(const char *corpus, FILE *output) {
+    int i;
+    int step;
+    int contact;
+    int down[MAX_SUPPORTED_CONTACTS] = {0};
+
+    srand(1);
+
+    if (strcmp(corpus, "taps") == 0) {
+        for (i = 0; i < 50000; ++i) {
+            fprintf(output, "d 0 %d %d 50\nc\nu 0\nc\n", rand() % 1080, rand() % 1920);
+        }
+    } else if (strcmp(corpus, "chaos") == 0) {
+        for (i = 0; i < 20000; ++i) {
+            for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+                int roll = rand() % 10;
+
+                if (!down[contact] && roll < 5) {
+                    fprintf(output, "d %d %d %d 50\n", contact, rand() % 1080, rand() % 1920);
+                    down[contact] = 1;
+                } else if (down[contact] && roll < 7) {
+                    fprintf(output, "m %d %d %d 50\n", contact, rand() % 1080, rand() % 1920);
+                } else if (down[contact] && roll < 8) {
+                    fprintf(output, "u %d\n", contact);
+                    down[contact] = 0;
+                }
+            }
+
+            fprintf(output, "c\n");
+        }
+    } else if (strcmp(corpus, "swipes") == 0) {
+        for (i = 0; i < 1000; ++i) {
+            int y = rand() % 1920;
+
+            fprintf(output, "d 0 0 %d 50\nc\n", y);
+
+            for (step = 1; step <= 100; ++step) {
+                fprintf(output, "m 0 %d %d 50\nc\n", step * 10, y);
+            }
+
+            fprintf(output, "u 0\nc\n");
+        }
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * 通过 io_handler 回放基准测试指令集并输出吞吐量和每帧开销
+ * @param corpus 指令集名称，all 表示全部
+ * @param state
+ * @return
+ */
+static int run_benchmark(const char *corpus, internal_state_touchpad_t *state) {
+    const char *corpora[] = {"taps", "chaos", "swipes"};
+    int output_fd = open("/dev/null", O_WRONLY);
+    int i;
+    int contact;
+
+    printf("%-8s %12s %12s %14s %14s %10s\n",
+           "corpus", "commands/s", "events/s", "frame p50 ns", "frame p99 ns", "rejected");
+
+    for (i = 0; i < 3; ++i) {
+        if (strcmp(corpus, "all") != 0 && strcmp(corpus, corpora[i]) != 0) {
+            continue;
+        }
+
+        FILE *input = tmpfile();
+
+        if (input == NULL || write_corpus(corpora[i], input) < 0) {
+            perror("tmpfile");
+            return EXIT_FAILURE;
+        }
+
+        fflush(input);
+        lseek(fileno(input), 0, SEEK_SET);
+
+        memset(&g_stats, 0, sizeof(g_stats));
+        state->capture_len = 0;
+        state->active_contacts = 0;
+
+        for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
+            state->contacts[contact].enabled = 0;
+        }
+
+        uint64_t started = now_ns();
+        io_handler(fileno(input), output_fd, state);
+        double elapsed = (now_ns() - started) / 1e9;
+
+        printf("%-8s %12.0f %12.0f %14llu %14llu %10llu\n", corpora[i],
+               g_stats.commands / elapsed, g_stats.events / elapsed,
+               (unsigned long long) histogram_percentile(&g_stats.frame_cost_ns, 50),
+               (unsigned long long) histogram_percentile(&g_stats.frame_cost_ns, 99),
+               (unsigned long long) g_stats.rejected);
+
+        fclose(input);
+    }
+
+    close(output_fd);
+
+    return EXIT_SUCCESS;
+}
+
+#define TRACE_MAGIC "MTTR"
+#define TRACE_VERSION 1
+#define TRACE_FRAME_SIZE 1024 // 一帧编码后的最大长度，每个触控点最多两条记录
+
+enum {
+    TRACE_DOWN,
+    TRACE_MOVE,
+    TRACE_UP,
+};
+
+typedef struct {
+    int active; // 已作为 down 写入轨迹
+    int down; // 本帧按下（或换了 tracking id）
+    int up; // 本帧抬起
+    int tracking_id;
+    int x, y, pressure; // 设备当前的值
+    int sent_x, sent_y, sent_pressure; // 最近写入轨迹的值，作为差分的基准
+} trace_slot_t;
+
+typedef struct {
+    FILE *file;
+    int slot; // 当前的 ABS_MT_SLOT
+    int tracking_id; // 最近写入的 tracking id，作为差分的基准
+    uint64_t time; // 最近写入的帧的时间（微秒）
+    uint64_t frames;
+    trace_slot_t slots[MAX_SUPPORTED_CONTACTS];
+} trace_recorder_t;
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_stop_signal(int signum) {
+    g_stop = 1;
+}
+
+static uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static unsigned char *put_varint(unsigned char *cursor, uint64_t value) {
+    while (value >= 0x80) {
+        *cursor++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+
+    *cursor++ = (unsigned char) value;
+
+    return cursor;
+}
+
+/**
+ * 从轨迹文件读取一个 LEB128 变长整数
+ * @param file
+ * @param value
+ * @return 0 成功，-1 文件已结束或数据不完整
+ */
+static int read_varint(FILE *file, uint64_t *value) {
+    int shift = 0;
+    int c;
+
+    *value = 0;
+
+    while ((c = getc(file)) != EOF && shift < 64) {
+        *value |= (uint64_t) (c & 0x7f) << shift;
+
+        if (!(c & 0x80)) {
+            return 0;
+        }
+
+        shift += 7;
+    }
+
+    return -1;
+}
+
+static unsigned char *put_trace_position(unsigned char *cursor, trace_slot_t *slot) {
+    cursor = put_varint(cursor, zigzag_encode((int64_t) slot->x - slot->sent_x));
+    cursor = put_varint(cursor, zigzag_encode((int64_t) slot->y - slot->sent_y));
+    cursor = put_varint(cursor, zigzag_encode((int64_t) slot->pressure - slot->sent_pressure));
+
+    slot->sent_x = slot->x;
+    slot->sent_y = slot->y;
+    slot->sent_pressure = slot->pressure;
+
+    return cursor;
+}
+
+/**
+ * 把自上一帧以来有变化的触控点编码成一帧写入轨迹，没有变化时不写
+ * @param recorder
+ * @param time 帧的时间（微秒）
+ */
+static void write_trace_frame(trace_recorder_t *recorder, uint64_t time) {
+    unsigned char records[TRACE_FRAME_SIZE];
+    unsigned char header[20];
+    unsigned char *cursor = records;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < MAX_SUPPORTED_CONTACTS; ++i) {
+        trace_slot_t *slot = &recorder->slots[i];
+
+        if (slot->up && slot->active) {
+            cursor = put_varint(cursor, (uint64_t) i << 2 | TRACE_UP);
+            slot->active = 0;
+            count += 1;
+        }
+
+        if (slot->down) {
+            cursor = put_varint(cursor, (uint64_t) i << 2 | TRACE_DOWN);
+            cursor = put_varint(cursor, zigzag_encode((int64_t) slot->tracking_id - recorder->tracking_id));
+            cursor = put_trace_position(cursor, slot);
+            recorder->tracking_id = slot->tracking_id;
+            slot->active = 1;
+            count += 1;
+        } else if (slot->active && (slot->x != slot->sent_x || slot->y != slot->sent_y ||
+                                    slot->pressure != slot->sent_pressure)) {
+            cursor = put_varint(cursor, (uint64_t) i << 2 | TRACE_MOVE);
+            cursor = put_trace_position(cursor, slot);
+            count += 1;
+        }
+
+        slot->down = 0;
+        slot->up = 0;
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    // The delta is kept relative to the last frame written, so idle
+    // stretches in between add up correctly.
+    unsigned char *end = put_varint(header, time > recorder->time ? time - recorder->time : 0);
+    end = put_varint(end, count);
+
+    fwrite(header, 1, end - header, recorder->file);
+    fwrite(records, 1, cursor - records, recorder->file);
+
+    recorder->time = time;
+    recorder->frames += 1;
+}
+
+/**
+ * 按 type B 协议跟踪触控设备的每个槽位，SYN_REPORT 时写出一帧
+ * @param recorder
+ * @param ev
+ */
+static void record_trace_event(trace_recorder_t *recorder, const struct input_event *ev) {
+    trace_slot_t *slot;
+
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+        write_trace_frame(recorder, (uint64_t) ev->time.tv_sec * 1000000 + ev->time.tv_usec);
+        return;
+    }
+
+    if (ev->type != EV_ABS) {
+        return;
+    }
+
+    if (ev->code == ABS_MT_SLOT) {
+        recorder->slot = ev->value;
+        return;
+    }
+
+    // Slots past what minitouch can replay are not recorded at all.
+    if (recorder->slot < 0 || recorder->slot >= MAX_SUPPORTED_CONTACTS) {
+        return;
+    }
+
+    slot = &recorder->slots[recorder->slot];
+
+    switch (ev->code) {
+        case ABS_MT_TRACKING_ID:
+            if (ev->value < 0) {
+                // A down that was never written is simply dropped.
+                if (slot->down) {
+                    slot->down = 0;
+                } else if (slot->active) {
+                    slot->up = 1;
+                }
+            } else {
+                // A new tracking id on a live slot is a new contact.
+                if (slot->active) {
+                    slot->up = 1;
+                }
+                slot->down = 1;
+                slot->tracking_id = ev->value;
+            }
+            break;
+        case ABS_MT_POSITION_X:
+            slot->x = ev->value;
+            break;
+        case ABS_MT_POSITION_Y:
+            slot->y = ev->value;
+            break;
+        case ABS_MT_PRESSURE:
+            slot->pressure = ev->value;
+            break;
+    }
+}
+
+/**
+ * 录制触控设备上的操作，直到收到 SIGINT 或 SIGTERM。轨迹文件的格式：
+ *
+ *   头部  "MTTR"，之后是变长整数 version、max_contacts、max_x、max_y、max_pressure
+ *   每帧  变长整数 与上一帧的时间差（微秒）、记录数，之后是各条记录
+ *   记录  变长整数 slot << 2 | kind（0 down、1 move、2 up），
+ *         down 之后是 tracking id 与上一个 down 的差，down 和 move 之后是
+ *         x、y、pressure 与该槽位上次写入的值的差，有符号的差都先做 zigzag 编码
+ *
+ * @param path
+ * @param state
+ * @return
+ */
+static int run_record(const char *path, internal_state_touchpad_t *state) {
+    struct libevdev *evdev = state->evdev;
+    struct input_event events[SOURCE_EVENT_BATCH];
+    unsigned char header[64];
+    unsigned char *end;
+    trace_recorder_t recorder;
+    struct pollfd pfd;
+    size_t count;
+    size_t i;
+    int fd = libevdev_get_fd(evdev);
+    int slot;
+    int rc;
+
+    if (!state->has_mtslot) {
+        fprintf(stderr, "Recording needs a type B touch device\n");
+        return EXIT_FAILURE;
+    }
 
-    int contact;  //触控点数量
-    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact) {
-        state_touchpad.contacts[contact].enabled = 0;
+    memset(&recorder, 0, sizeof(recorder));
+    recorder.file = fopen(path, "wb");
+
+    if (recorder.file == NULL) {
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
     }
 
-    fprintf(stderr,
-            "%s touch device %s (%dx%d with %d contacts) detected on %s (score %d)\n",
-            state_touchpad.has_mtslot ? "Type B" : "Type A", //根据触控槽来判断是什么协议类型
-            libevdev_get_name(state_touchpad.evdev),
-            state_touchpad.max_x, state_touchpad.max_y, state_touchpad.max_contacts,
-            state_touchpad.path, state_touchpad.score
-    );
+    memcpy(header, TRACE_MAGIC, 4);
+    end = put_varint(header + 4, TRACE_VERSION);
+    end = put_varint(end, state->max_contacts);
+    end = put_varint(end, state->max_x);
+    end = put_varint(end, state->max_y);
+    end = put_varint(end, state->max_pressure);
+    fwrite(header, 1, end - header, recorder.file);
+
+    // Event timestamps must not jump with the wall clock, and must be
+    // comparable to now_us() for the first and last frame.
+    libevdev_set_clock_id(evdev, CLOCK_MONOTONIC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    // Contacts already down go into the first frame.
+    recorder.slot = libevdev_get_current_slot(evdev);
+    for (slot = 0; slot < MAX_SUPPORTED_CONTACTS && slot < state->max_contacts; ++slot) {
+        trace_slot_t *s = &recorder.slots[slot];
+
+        s->tracking_id = libevdev_get_slot_value(evdev, slot, ABS_MT_TRACKING_ID);
+        s->x = libevdev_get_slot_value(evdev, slot, ABS_MT_POSITION_X);
+        s->y = libevdev_get_slot_value(evdev, slot, ABS_MT_POSITION_Y);
+        s->pressure = libevdev_get_slot_value(evdev, slot, ABS_MT_PRESSURE);
+        s->down = s->tracking_id >= 0;
+    }
 
-    if (state_touchpad.max_contacts > MAX_SUPPORTED_CONTACTS) {
-        fprintf(stderr, "Note: hard-limiting maximum number of contacts to %d\n",
-                MAX_SUPPORTED_CONTACTS);
-        state_touchpad.max_contacts = MAX_SUPPORTED_CONTACTS;
+    recorder.time = now_us();
+
+    fprintf(stderr, "Recording %s to '%s', interrupt to stop\n", state->path, path);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (!g_stop) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        do {
+            rc = libevdev_next_events(evdev, LIBEVDEV_READ_FLAG_NORMAL,
+                                      events, SOURCE_EVENT_BATCH, &count);
+
+            for (i = 0; i < count; ++i) {
+                record_trace_event(&recorder, &events[i]);
+            }
+
+            // The sync delta ends in a SYN_REPORT of its own, so it is
+            // written out as one frame.
+            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
+                rc = libevdev_next_events(evdev, LIBEVDEV_READ_FLAG_SYNC,
+                                          events, SOURCE_EVENT_BATCH, &count);
+                for (i = 0; i < count; ++i) {
+                    record_trace_event(&recorder, &events[i]);
+                }
+            }
+        } while (rc == LIBEVDEV_READ_STATUS_SUCCESS);
+
+        if (rc != -EAGAIN && rc != -EINTR) {
+            fprintf(stderr, "Unable to read %s: %s\n", state->path, strerror(-rc));
+            break;
+        }
+    }
+
+    // Never leave a contact down at the end of a trace.
+    for (slot = 0; slot < MAX_SUPPORTED_CONTACTS; ++slot) {
+        recorder.slots[slot].down = 0;
+        recorder.slots[slot].up = 1;
+    }
+
+    write_trace_frame(&recorder, now_us());
+
+    fprintf(stderr, "Recorded %llu frames (%ld bytes) to '%s'\n",
+            (unsigned long long) recorder.frames, ftell(recorder.file), path);
+
+    if (fclose(recorder.file) != 0) {
+        perror("fclose");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static long scale_trace_value(long value, long from, long to) {
+    if (from <= 0 || from == to) {
+        return value;
+    }
+
+    return (long) (((int64_t) value * to + from / 2) / from);
+}
+
+/**
+ * 按录制时的时间间隔回放轨迹，经 apply_command 执行 d、m、u 和 c，
+ * 坐标和压力按录制设备与当前设备的范围缩放
+ * @param path
+ * @param speed 回放速度倍数，2 表示两倍速
+ * @param state
+ * @return
+ */
+static int run_replay(const char *path, double speed, internal_state_touchpad_t *state) {
+    FILE *file = fopen(path, "rb");
+    char magic[4];
+    uint64_t version, max_contacts, max_x, max_y, max_pressure;
+    uint64_t delta, count, key, value;
+    uint64_t elapsed = 0;
+    uint64_t frames = 0;
+    uint64_t started;
+    long x[MAX_SUPPORTED_CONTACTS] = {0};
+    long y[MAX_SUPPORTED_CONTACTS] = {0};
+    long pressure[MAX_SUPPORTED_CONTACTS] = {0};
+    int down[MAX_SUPPORTED_CONTACTS] = {0};
+    command_t command;
+    int slot;
+    int kind;
+    int result = EXIT_SUCCESS;
+
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+        read_varint(file, &version) < 0 || version != TRACE_VERSION ||
+        read_varint(file, &max_contacts) < 0 || read_varint(file, &max_x) < 0 ||
+        read_varint(file, &max_y) < 0 || read_varint(file, &max_pressure) < 0) {
+        fprintf(stderr, "'%s' is not a minitouch trace\n", path);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Replaying '%s' (%llux%llu with %llu contacts) at %gx\n", path,
+            (unsigned long long) max_x, (unsigned long long) max_y,
+            (unsigned long long) max_contacts, speed);
+
+    memset(&command, 0, sizeof(command));
+    started = now_us();
+
+    while (!g_stop && read_varint(file, &delta) == 0) {
+        if (read_varint(file, &count) < 0) {
+            goto truncated;
+        }
+
+        elapsed += delta;
+        sleep_until(started + (uint64_t) (elapsed / speed));
+
+        command.received = now_us();
+
+        while (count-- > 0) {
+            if (read_varint(file, &key) < 0) {
+                goto truncated;
+            }
+
+            slot = (int) (key >> 2);
+            kind = (int) (key & 3);
+
+            if (slot >= MAX_SUPPORTED_CONTACTS || kind > TRACE_UP) {
+                goto truncated;
+            }
+
+            if (kind == TRACE_UP) {
+                command.op = 'u';
+                down[slot] = 0;
+            } else {
+                // The tracking id is kept for tools reading the trace,
+                // minitouch hands out its own.
+                if (kind == TRACE_DOWN && read_varint(file, &value) < 0) {
+                    goto truncated;
+                }
+
+                if (read_varint(file, &value) < 0) {
+                    goto truncated;
+                }
+                x[slot] += zigzag_decode(value);
+
+                if (read_varint(file, &value) < 0) {
+                    goto truncated;
+                }
+                y[slot] += zigzag_decode(value);
+
+                if (read_varint(file, &value) < 0) {
+                    goto truncated;
+                }
+                pressure[slot] += zigzag_decode(value);
+
+                command.op = kind == TRACE_DOWN ? 'd' : 'm';
+                command.x = scale_trace_value(x[slot], max_x, state->max_x);
+                command.y = scale_trace_value(y[slot], max_y, state->max_y);
+                command.pressure = scale_trace_value(pressure[slot], max_pressure, state->max_pressure);
+                down[slot] = 1;
+            }
+
+            command.contact = slot;
+            apply_command(&command, state);
+        }
+
+        command.op = 'c';
+        apply_command(&command, state);
+        frames += 1;
+    }
+
+    goto done;
+
+truncated:
+    fprintf(stderr, "Trace '%s' is truncated or corrupt\n", path);
+    result = EXIT_FAILURE;
+
+done:
+    // Lift whatever an interrupted or broken trace left down.
+    command.op = 'u';
+    for (slot = 0; slot < MAX_SUPPORTED_CONTACTS; ++slot) {
+        if (down[slot]) {
+            command.contact = slot;
+            apply_command(&command, state);
+        }
+    }
+
+    command.op = 'c';
+    apply_command(&command, state);
+
+    fprintf(stderr, "Replayed %llu frames in %.3fs\n", (unsigned long long) frames,
+            (now_us() - started) / 1e6);
+
+    fclose(file);
+
+    return result;
+}
+
+/**
+ * 预先访问栈，使其在 mlockall 之后常驻内存，注入时不会再因栈增长而缺页
+ */
+static void prefault_stack(void) {
+    volatile char stack[PREFAULT_STACK_SIZE];
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * 让当前线程（注入线程）进入实时模式。之后创建的线程会继承调度策略和 CPU 绑定，
+ * 所以要在创建其他线程之后调用
+ * @param priority SCHED_FIFO 优先级，0 表示保持原来的调度策略，也不锁定内存
+ * @param cpu 绑定的 CPU，-1 表示不绑定
+ */
+static void enter_realtime(int priority, int cpu) {
+    struct sched_param param;
+    cpu_set_t cpus;
+
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            fprintf(stderr, "Unable to pin to CPU %d: %s\n", cpu, strerror(errno));
+        }
+    }
+
+    if (priority <= 0) {
+        return;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        // Without CAP_SYS_NICE, at least get ahead of every other normal thread.
+        fprintf(stderr, "Unable to use SCHED_FIFO: %s, raising the priority instead\n",
+                strerror(errno));
+
+        if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), -20) < 0) {
+            fprintf(stderr, "Unable to raise the priority: %s\n", strerror(errno));
+        }
+    }
+
+    // All frame, client and queue buffers are static, so locking what is
+    // mapped now faults them in once and for all. MCL_FUTURE covers rings
+    // mapped and scripts compiled later on.
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "Unable to lock memory: %s\n", strerror(errno));
+    }
+
+    prefault_stack();
+}
+
+/**
+ * 测量定时唤醒的延迟：每 JITTER_PERIOD_US 睡眠到一个绝对时间，记录实际醒来晚了多少
+ * @param seconds
+ * @return
+ */
+static int run_jitter_test(int seconds) {
+    static histogram_t histogram;
+    struct timespec wakeup;
+    uint64_t target = now_ns();
+    uint64_t end = target + (uint64_t) seconds * 1000000000;
+    int policy = sched_getscheduler(0);
+    struct sched_param param;
+    char buffer[256];
+
+    fprintf(stderr, "Measuring wake-up latency for %d seconds\n", seconds);
+
+    while (target < end && !g_stop) {
+        target += JITTER_PERIOD_US * 1000;
+        wakeup.tv_sec = target / 1000000000;
+        wakeup.tv_nsec = target % 1000000000;
+
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) != 0) {
+            continue;
+        }
+
+        histogram_record(&histogram, (now_ns() - target) / 1000);
+    }
+
+    sched_getparam(0, &param);
+    format_histogram(buffer, sizeof(buffer), "wakeup_us", &histogram);
+    printf("j policy=%s priority=%d nice=%d samples=%llu%s\n",
+           policy == SCHED_FIFO ? "fifo" : "other", param.sched_priority,
+           getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid)),
+           (unsigned long long) histogram.total, buffer);
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) { //入口函数
+    const char *pname = argv[0];
+    const char *devroot = "/dev/input"; //设备的输入事件目录
+    char *device = NULL;
+    char *sockname = DEFAULT_SOCKET_NAME; //宏定义
+    char *stdin_file = NULL;
+    int use_stdin = 0;
+    char *fake_device = NULL;
+    char *sink = "null";
+    char *benchmark = NULL;
+    int use_uinput = 0;
+    char *cache_file = DEFAULT_CACHE_FILE;
+    char *keymap_file = NULL;
+    char *record_file = NULL;
+    char *replay_file = NULL;
+    double replay_speed = 1;
+    char *tcp_spec = NULL;
+    int pace_rate = 0;
+    int realtime_priority = 0;
+    int cpu = -1;
+    int jitter_seconds = 0;
+    int all_touch_devices = 0;
+
+    enum {
+        OPTION_REALTIME = 256,
+        OPTION_CPU,
+        OPTION_JITTER_TEST,
+    };
+
+    static const struct option long_options[] = {
+            {"realtime",    optional_argument, NULL, OPTION_REALTIME},
+            {"cpu",         required_argument, NULL, OPTION_CPU},
+            {"jitter-test", optional_argument, NULL, OPTION_JITTER_TEST},
+            {NULL, 0,                          NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:n:vif:r:uF:S:b:C:k:o:t:x:p:P:Ah",
+                              long_options, NULL)) != -1) { // 命令行参数
+        switch (opt) {
+            case 'd':
+                device = optarg;
+                break;
+            case 'n':
+                sockname = optarg;
+                break;
+            case 'v':
+                g_verbose = 1;
+                break;
+            case 'i':
+                use_stdin = 1;
+                break;
+            case 'f':
+                stdin_file = optarg;
+                break;
+            case 'r':
+                g_frame_rate = atoi(optarg);
+                if (g_frame_rate <= 0) {
+                    fprintf(stderr, "Invalid frame rate '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                use_uinput = 1;
+                break;
+            case 'F':
+                fake_device = optarg;
+                break;
+            case 'S':
+                sink = optarg;
+                break;
+            case 'b':
+                benchmark = optarg;
+                break;
+            case 'C':
+                cache_file = optarg;
+                break;
+            case 'k':
+                keymap_file = optarg;
+                break;
+            case 'o':
+                record_file = optarg;
+                break;
+            case 't':
+                replay_file = optarg;
+                break;
+            case 'x':
+                replay_speed = strtod(optarg, NULL);
+                if (replay_speed <= 0) {
+                    fprintf(stderr, "Invalid replay speed '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                tcp_spec = optarg;
+                break;
+            case 'P':
+                pace_rate = atoi(optarg);
+                if (pace_rate <= 0) {
+                    fprintf(stderr, "Invalid refresh rate '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'A':
+                all_touch_devices = 1;
+                break;
+            case OPTION_REALTIME:
+                realtime_priority = optarg != NULL ? atoi(optarg) : DEFAULT_REALTIME_PRIORITY;
+                if (realtime_priority < sched_get_priority_min(SCHED_FIFO) ||
+                    realtime_priority > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "Invalid priority '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_CPU:
+                cpu = atoi(optarg);
+                if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid CPU '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_JITTER_TEST:
+                jitter_seconds = optarg != NULL ? atoi(optarg) : DEFAULT_JITTER_SECONDS;
+                if (jitter_seconds <= 0) {
+                    fprintf(stderr, "Invalid duration '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case '?':
+                usage(pname);
+                return EXIT_FAILURE;
+            case 'h':
+                usage(pname);
+                return EXIT_SUCCESS;
+        }
+    }
+
+    if (jitter_seconds > 0) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_stop_signal;
+        sigaction(SIGINT, &action, NULL);
+
+        enter_realtime(realtime_priority, cpu);
+        return run_jitter_test(jitter_seconds);
+    }
+
+    internal_state_touchpad_t state_touchpad = {0}; // 对触摸设备的结构体初始化
+
+    g_keymap_file = keymap_file; // 决定是否独占鼠标和手柄，检测设备前设置
+
+    if (benchmark != NULL && fake_device == NULL) {
+        fake_device = "b";
+    }
+
+    if (record_file != NULL && fake_device != NULL) {
+        fprintf(stderr, "Recording needs a real touch device\n");
+        return EXIT_FAILURE;
+    }
+
+    //程序第一次运行时，检测是否有可触控设备及键盘设备
+    if (fake_device != NULL) {
+        if (setup_fake_device(fake_device, sink, &state_touchpad) < 0) {
+            return EXIT_FAILURE;
+        }
+    } else if (device != NULL) { //指定设备
+        if (!consider_touch_device(device, &state_touchpad)) {  //判断触控设备是否可用
+            fprintf(stderr, "%s is not a supported touch device\n", device);
+            return EXIT_FAILURE;
+        }
+    } else { //非指定设备 //dev/input/eventX
+        int cached = *cache_file != '\0' && load_cached_touch_device(cache_file, &state_touchpad);
+
+        // A cache hit only skips scoring; keyboards are still looked for,
+        // but only when serving the socket, since nothing reads them otherwise.
+        int with_sources = !use_stdin && stdin_file == NULL &&
+                           record_file == NULL && replay_file == NULL;
+        if (walk_devices(devroot, cached ? NULL : &state_touchpad, with_sources) != 0) {
+            fprintf(stderr, "Unable to crawl %s for touch devices\n", devroot);
+            return EXIT_FAILURE; //退出程序
+        }
+
+        if (!cached && state_touchpad.score > 0 && *cache_file != '\0') {
+            save_cached_touch_device(cache_file, &state_touchpad);
+        }
+    }
+
+    if (fake_device == NULL) {
+        if (state_touchpad.score <= 0 || open_touch_device(&state_touchpad) < 0) {
+            fprintf(stderr, "Unable to find a suitable touch device\n");
+            return EXIT_FAILURE;
+        }
+
+        setup_touch_device(&state_touchpad);
+
+        // Recording reads the device itself, never inject into a copy.
+        if (use_uinput && record_file == NULL) {
+            setup_uinput_device(&state_touchpad);
+        }
+    }
+
+    int i;
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+        g_clients[i].fd = -1;
+    }
+
+    memset(g_input_client.contacts, 0xff, sizeof(g_input_client.contacts));
+
+    g_input_client.fd = -1;
+    g_input_client.output_fd = -1;
+
+    // A client hanging up mid-write must not take the whole process down.
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 dumps the statistics to stderr. No SA_RESTART, so that the
+    // blocking read or epoll_wait returns and the main loop gets to it.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_dump_stats_signal;
+    sigaction(SIGUSR1, &action, NULL);
+
+    // Serving starts the input thread first, see below.
+    if (benchmark != NULL || record_file != NULL || replay_file != NULL ||
+        use_stdin || stdin_file != NULL) {
+        enter_realtime(realtime_priority, cpu);
+    }
+
+    if (benchmark != NULL) {
+        return run_benchmark(benchmark, &state_touchpad);
     }
 
-    FILE *input;
-    FILE *output;
+    if (record_file != NULL || replay_file != NULL) {
+        // Stop cleanly, so that the trace is complete and no contact is
+        // left down on the device.
+        action.sa_handler = on_stop_signal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+
+        if (record_file != NULL) {
+            return run_record(record_file, &state_touchpad);
+        }
+
+        return run_replay(replay_file, replay_speed, &state_touchpad);
+    }
 
     if (use_stdin || stdin_file != NULL) {
+        int input_fd;
+
         if (stdin_file != NULL) {
             // Reading from a file
-            input = fopen(stdin_file, "r");
-            if (NULL == input) {
+            input_fd = open(stdin_file, O_RDONLY);
+            if (input_fd < 0) {
                 fprintf(stderr, "Unable to open '%s': %s\n",
                         stdin_file, strerror(errno));
                 exit(EXIT_FAILURE);
@@ -1202,19 +6357,21 @@ int main(int argc, char *argv[]) { //入口函数
             }
         } else {
             // Reading from terminal
-            input = stdin;
+            input_fd = STDIN_FILENO;
             fprintf(stderr, "Reading from STDIN\n");
         }
 
-        output = stderr;
-        io_handler(input, output, &state_touchpad);
-        fclose(input);
-        fclose(output);
-        exit(EXIT_SUCCESS);
-    }
+        // Script files are compiled up front, only STDIN and anything that
+        // can't be mapped is executed as it is read.
+        int result = stdin_file != NULL ? play_script(input_fd, STDERR_FILENO, &state_touchpad) : 0;
 
-    struct sockaddr_un client_addr;
-    socklen_t client_addr_length = sizeof(client_addr);
+        if (result == 0) {
+            io_handler(input_fd, STDERR_FILENO, &state_touchpad);
+        }
+
+        close(input_fd);
+        exit(result < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
     int server_fd = start_server(sockname); // 开启服务端socket
 
@@ -1223,58 +6380,62 @@ int main(int argc, char *argv[]) { //入口函数
         return EXIT_FAILURE;
     }
 
-    state_waper.keyboard = state_keyboard;
-    state_waper.touchpad = state_touchpad;
-
-    if(state_keyboard.evdev!=0){
-        pthread_t keyboardThread;
+    int tcp_fd = tcp_spec != NULL ? start_tcp_server(tcp_spec) : -1;
 
-        pthread_create(&keyboardThread, NULL, (void *) &listen_keyboard_input,
-                       (void *) &state_waper);
-    } else{
-        fprintf(stderr,">>> keyboard device not found\n");
+    if (tcp_spec != NULL && tcp_fd < 0) {
+        fprintf(stderr, "Unable to start server on %s\n", tcp_spec);
+        return EXIT_FAILURE;
     }
 
-    pthread_t watcherThread;
-    pthread_create(&watcherThread,NULL,(void *)&watch_inotify,&state_waper);
-
+    // The input thread only produces commands, all of them are executed
+    // here by serve(), which alone owns the touch state and device fd.
+    if (command_queue_init(&g_commands) < 0) {
+        perror("eventfd");
+        return EXIT_FAILURE;
+    }
 
-    while (1) { //监听socket客户端发送的消息
-        int client_fd = accept(server_fd, (struct sockaddr *) &client_addr,
-                               &client_addr_length);
+    g_keymap = keymap_file != NULL ? load_keymap(keymap_file) : default_keymap();
 
-        if (client_fd < 0) {
-            perror("accepting client");
-            exit(1);
-        }
+    if (g_keymap == NULL) {
+        return EXIT_FAILURE;
+    }
 
-        fprintf(stderr, "Connection established\n");
+    // Only what is served is paced, scripts and STDIN keep their own timing.
+    if (pace_rate > 0) {
+        state_touchpad.pace_period = 1000000000 / pace_rate;
+    }
 
-        input = fdopen(client_fd, "r");
-        if (input == NULL) {
-            fprintf(stderr, "%s: fdopen(client_fd,'r')\n", strerror(errno));
-            exit(1);
-        }
+    // Extras come from the autodetection walk and are written directly.
+    if (all_touch_devices && fake_device == NULL && device == NULL && state_touchpad.uinput == NULL) {
+        open_extra_touch_devices(&state_touchpad);
+    } else if (all_touch_devices) {
+        fprintf(stderr, "Note: -A needs an autodetected device without -u, ignoring\n");
+    }
 
-        output = fdopen(dup(client_fd), "w");
-        if (output == NULL) {
-            fprintf(stderr, "%s: fdopen(client_fd,'w')\n", strerror(errno));
-            exit(1);
-        }
+    // Only an autodetected device that events go straight into follows
+    // hotplug. A uinput copy lives on regardless of the real device, and
+    // with -A clients have picked their devices by number.
+    state_touchpad.serial = registered_serial(state_touchpad.path);
+    g_touch_hotplug = fake_device == NULL && device == NULL && state_touchpad.uinput == NULL &&
+                      state_touchpad.serial != 0 && g_touch_device_count == 1;
 
-        io_handler(input, output, &state_touchpad);
+    pthread_t inputThread;
+    pthread_create(&inputThread, NULL, run_input_reactor, (void *) devroot);
 
-        fprintf(stderr, "Connection closed\n");
-        fclose(input);
-        fclose(output);
-        close(client_fd);
-    }
+    // Only now, so that the input thread keeps the default policy and CPUs.
+    enter_realtime(realtime_priority, cpu);
 
+    serve(server_fd, tcp_fd, &state_touchpad);
 
     close(server_fd);
 
     libevdev_free(state_touchpad.evdev);
     close(state_touchpad.fd);
 
+    for (i = 1; i < g_touch_device_count; ++i) {
+        libevdev_free(g_extra_touch_devices[i - 1].evdev);
+        close(g_extra_touch_devices[i - 1].fd);
+    }
+
     return EXIT_SUCCESS;
 }